@@ -49,10 +49,11 @@ namespace helpers {
 
   const char* hexToStr(const uint8_t *s, uint8_t len)
   {
-    static char output[1000];
-    if (len * 3 + 1 > sizeof(output))
+    // Sized for a MAC address: 6 bytes with the separators and the null character
+    static char output[18];
+    if (len * 3 > sizeof(output))
     {
-      sprintf(output, "buffer overflow in hexToStr");
+      output[0] = 0x00;
       return output;
     }
     char *ptr = &output[0];
@@ -64,4 +65,29 @@ namespace helpers {
       ptr += sprintf(ptr, "%02X", s[i]);
     return output;
   }
+
+  const char* ipToStr(uint32_t ip)
+  {
+    static char output[16];
+    sprintf(output, "%u.%u.%u.%u", (unsigned int)(ip & 0xFF), (unsigned int)((ip >> 8) & 0xFF),
+            (unsigned int)((ip >> 16) & 0xFF), (unsigned int)(ip >> 24));
+    return output;
+  }
+
+  // FNV-1a hash of a string, the hash of the previous strings can be given to chain them
+  uint32_t fnv1a(const char* str, uint32_t hash)
+  {
+    if (str != NULL)
+    {
+      while (*str)
+      {
+        hash ^= (uint8_t)(*str++);
+        hash *= 16777619UL;
+      }
+    }
+    // Separator so that ("ab","c") and ("a","bc") give different hashes
+    hash ^= 0xFF;
+    hash *= 16777619UL;
+    return hash;
+  }
 }
@@ -2,23 +2,88 @@
 #define CONFIG
 
 
-// For the Shelly Dimmer 2
-/*
-#define SHELLY_BUILTIN_LED 16
-#define SHELLY_SW1 14
-#define SHELLY_SW2 12
-#define SHELLY_BUILTIN_SWITCH 13
+#include <Arduino.h>
 
-#define STM_NRST_PIN 5
-#define STM_BOOT0_PIN 4
-*/
+// The board is selected with the build flag SHELLY_BOARD, e.g. -DSHELLY_BOARD=BOARD_SHELLY_25
+#define BOARD_SHELLY_1PM      1
+#define BOARD_SHELLY_DIMMER2  2     // Not supported: the build stops since the dimmer driven by the STM32 is not implemented
+#define BOARD_SHELLY_25       3     // Only the first relay is driven
+#ifndef SHELLY_BOARD
+#define SHELLY_BOARD BOARD_SHELLY_1PM
+#endif
+
+#define NO_PIN 255
+
+// Pins and hardware of each board, only known at compile time
+// SWITCH_PINS is indexed by the switch ID used in the MQTT messages and the rules, the ID 0 being the
+// built-in switch, NO_PIN for the IDs not wired. The code for the switches is unrolled for the wired IDs
+template <uint8_t BOARD> struct BoardTraits;
+
+template <> struct BoardTraits<BOARD_SHELLY_1PM>
+{
+  static constexpr char MODEL[] = "Shelly 1PM";   // Model name in the MQTT discovery
+  static constexpr uint8_t BUILTIN_LED = 0;
+  static constexpr uint8_t NB_SWITCH_IDS = 2;
+  static constexpr uint8_t SWITCH_PINS[NB_SWITCH_IDS] = {NO_PIN, 4};   // Built-in switch on GPIO2 quite unstable, not used
+  static constexpr uint8_t WAKEUP_SWITCH_ID = 1;
+  static constexpr uint8_t NB_RELAYS = 1;
+  static constexpr uint8_t RELAY_PINS[NB_RELAYS] = {15};
+  // NTC of the internal temperature: 3V3 --- bridge resistance ---v--- NTC --- Gnd, ADC on v
+  static constexpr uint8_t NTC_PIN = A0;
+  static constexpr uint32_t NTC_BRIDGE_RESISTANCE = 32000;
+  static constexpr uint32_t NTC_RESISTANCE = 10000;
+  static constexpr uint16_t NTC_B_COEFFICIENT = 3350;
+};
+
+// Pins kept for a future driver of the STM32, the light module refuses this board
+template <> struct BoardTraits<BOARD_SHELLY_DIMMER2>
+{
+  static constexpr char MODEL[] = "Shelly Dimmer 2";
+  static constexpr uint8_t BUILTIN_LED = 16;
+  static constexpr uint8_t NB_SWITCH_IDS = 3;
+  static constexpr uint8_t SWITCH_PINS[NB_SWITCH_IDS] = {NO_PIN, 14, 12};   // Built-in switch on GPIO13, not used
+  static constexpr uint8_t WAKEUP_SWITCH_ID = 1;
+  // The light is dimmed by the STM32, there is no relay
+  static constexpr uint8_t NB_RELAYS = 0;
+  static constexpr uint8_t RELAY_PINS[1] = {NO_PIN};
+  static constexpr uint8_t STM_NRST_PIN = 5;
+  static constexpr uint8_t STM_BOOT0_PIN = 4;
+  // Same NTC as the Shelly 1PM
+  static constexpr uint8_t NTC_PIN = A0;
+  static constexpr uint32_t NTC_BRIDGE_RESISTANCE = 32000;
+  static constexpr uint32_t NTC_RESISTANCE = 10000;
+  static constexpr uint16_t NTC_B_COEFFICIENT = 3350;
+};
+
+template <> struct BoardTraits<BOARD_SHELLY_25>
+{
+  static constexpr char MODEL[] = "Shelly 2.5";
+  static constexpr uint8_t BUILTIN_LED = 0;
+  static constexpr uint8_t NB_SWITCH_IDS = 3;
+  static constexpr uint8_t SWITCH_PINS[NB_SWITCH_IDS] = {NO_PIN, 13, 5};
+  static constexpr uint8_t WAKEUP_SWITCH_ID = 1;
+  // The light is switched by the first relay, the second one is not driven
+  static constexpr uint8_t NB_RELAYS = 2;
+  static constexpr uint8_t RELAY_PINS[NB_RELAYS] = {4, 15};
+  static constexpr uint8_t NTC_PIN = A0;
+  static constexpr uint32_t NTC_BRIDGE_RESISTANCE = 32000;
+  static constexpr uint32_t NTC_RESISTANCE = 10000;
+  static constexpr uint16_t NTC_B_COEFFICIENT = 3350;
+};
+
+typedef BoardTraits<SHELLY_BOARD> Board;
+
+// Blocks of 4 bytes in the RTC user memory, the first 64 blocks are used by the OTA update
+#define RTC_CLOCK_BLOCK 64        // Time and drift of the clock, 5 blocks
+#define RTC_WATCHDOG_BLOCK 69     // Stall and crash record of the watchdog, 27 blocks
 
-// For the Shelly 1PM
-#define SHELLY_BUILTIN_LED 0
-#define SHELLY_SW1 4
-//#define SHELLY_SW2 -1           // Not applicable
-//#define SHELLY_SW0 2            // Built-in switch -> quite unstable for the Shelly 1PM
-#define LIGHT_RELAY 15            // Relay for swtiching on/off the light
+// The long-lived objects (MQTT client, telnet server and buffers) are built once in static storage
+// and reinitialized in place, instead of being deleted and allocated again at each config save
+#define STATIC_ALLOCATION
+// Count the heap allocations, for checking that none is done in steady state
+// The firmware must be linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (see README.md),
+// without these flags the link fails on __real_malloc
+//#define ALLOCATION_COUNTER
 
 
   
@@ -27,6 +92,9 @@ namespace helpers {
   bool isInteger(const char* str, uint8_t maxLength=10);
   bool convertToInteger(const char* str, uint16_t &val, uint8_t maxLength=10);
   const char* hexToStr(const uint8_t *s, uint8_t len);
+  // Dotted form of an IPv4 address, without building a String
+  const char* ipToStr(uint32_t ip);
+  uint32_t fnv1a(const char* str, uint32_t hash=2166136261UL);
 }
 
 #endif
@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "light.h"
+#include "mqtt.h"
+#include "discovery.h"
+
+
+namespace discovery
+{
+
+//////////////////////////////////////////////////////////////////////////////
+// Home Assistant MQTT discovery                                            //
+// The config payloads are streamed into the MQTT packets and published    //
+// retained, only when the hash of the configuration has changed            //
+//////////////////////////////////////////////////////////////////////////////
+
+const char* const paramKeys[] = {"haDiscoveryPrefix", "hostname", "subMqttLightSet", "pubMqtt*", NULL};
+
+const char* prefix = NULL;
+const char* deviceName = NULL;
+
+// Print a string between quotes, escaping the characters not allowed in JSON
+void printJsonString(Print &out, const char* str)
+{
+  out.print('"');
+  while (*str)
+  {
+    // Write the characters up to the next one to escape at once
+    size_t len = strcspn(str, "\"\\");
+    out.write((const uint8_t*)str, len);
+    str += len;
+    if (*str)
+    {
+      out.print('\\');
+      out.print(*str);
+      str++;
+    }
+  }
+  out.print('"');
+}
+
+void printKey(Print &out, const __FlashStringHelper* key, const char* value)
+{
+  out.print(key);
+  printJsonString(out, value);
+}
+
+// The parts common to all the entities: availability and device
+void renderCommon(Print &out, const char* entity)
+{
+  char uniqueId[32];
+  snprintf(uniqueId, sizeof(uniqueId), "%s_%s", mqtt::getClientId(), entity);
+  printKey(out, F(",\"uniq_id\":"), uniqueId);
+  const char* statusTopic = wifi::getParamValueFromID("pubMqttStatus");
+  if (statusTopic != NULL)
+  {
+    printKey(out, F(",\"avty_t\":"), statusTopic);
+    out.print(F(",\"avty_tpl\":\"{{ value_json.status }}\""));
+  }
+  printKey(out, F(",\"dev\":{\"ids\":["), mqtt::getClientId());
+  printKey(out, F("],\"name\":"), deviceName);
+  printKey(out, F(",\"mdl\":"), Board::MODEL);
+  out.print(F(",\"mf\":\"Allterco\",\"sw\":\"" __DATE__ " " __TIME__ "\"}}"));
+}
+
+void renderSwitch(Print &out)
+{
+  out.print(F("{\"name\":\"Light\""));
+  printKey(out, F(",\"cmd_t\":"), wifi::getParamValueFromID("subMqttLightSet"));
+  // The state is read from the status, it does not depend on the brightness levels
+  printKey(out, F(",\"stat_t\":"), wifi::getParamValueFromID("pubMqttStatus"));
+  out.print(F(",\"pl_on\":\"ON\",\"pl_off\":\"OFF\",\"val_tpl\":\"{{ value_json.light }}\""));
+  renderCommon(out, "relay");
+}
+
+void renderTemperature(Print &out)
+{
+  out.print(F("{\"name\":\"Temperature\""));
+  printKey(out, F(",\"stat_t\":"), wifi::getParamValueFromID("pubMqttTemperature"));
+  out.print(F(",\"dev_cla\":\"temperature\",\"unit_of_meas\":\"°C\""));
+  renderCommon(out, "temperature");
+}
+
+void renderOverheat(Print &out)
+{
+  out.print(F("{\"name\":\"Overheat\""));
+  printKey(out, F(",\"stat_t\":"), wifi::getParamValueFromID("pubMqttStatus"));
+  out.print(F(",\"dev_cla\":\"heat\",\"val_tpl\":\"{{ 'ON' if value_json.overheat else 'OFF' }}\""));
+  renderCommon(out, "overheat");
+}
+
+// Hash of all the parameters used in the config payloads and of the broker receiving them,
+// so that a new broker gets the configs even if they have been published to another one
+uint32_t computeConfigHash()
+{
+  char port[6];
+  sprintf(port, "%u", mqtt::getBrokerPort());
+  uint32_t hash = helpers::fnv1a(mqtt::getBrokerHost());
+  hash = helpers::fnv1a(port, hash);
+  hash = helpers::fnv1a(prefix, hash);
+  hash = helpers::fnv1a(mqtt::getClientId(), hash);
+  hash = helpers::fnv1a(deviceName, hash);
+  hash = helpers::fnv1a(wifi::getParamValueFromID("subMqttLightSet"), hash);
+  hash = helpers::fnv1a(wifi::getParamValueFromID("pubMqttTemperature"), hash);
+  hash = helpers::fnv1a(wifi::getParamValueFromID("pubMqttStatus"), hash);
+  hash = helpers::fnv1a(__DATE__ " " __TIME__, hash);
+  return hash;
+}
+
+uint32_t readPublishedHash()
+{
+  uint32_t hash = 0;
+  File file = LittleFS.open("/discovery.hash", "r");
+  if (file)
+  {
+    file.read((uint8_t*)&hash, sizeof(hash));
+    file.close();
+  }
+  return hash;
+}
+
+void writePublishedHash(uint32_t hash)
+{
+  File file = LittleFS.open("/discovery.hash", "w");
+  if (file)
+  {
+    file.write((const uint8_t*)&hash, sizeof(hash));
+    file.close();
+  }
+}
+
+bool publishEntity(const char* component, const char* entity, void (*render)(Print &out))
+{
+  char topic[128];
+  snprintf(topic, sizeof(topic), "%s/%s/%s/%s/config", prefix, component, mqtt::getClientId(), entity);
+  return mqtt::publishMQTTStream(topic, render, true);
+}
+
+void publishConfig()
+{
+  // Discovery is disabled without prefix
+  prefix = wifi::getParamValueFromID("haDiscoveryPrefix");
+  if (prefix == NULL || !mqtt::isConnected())
+    return;
+  deviceName = wifi::getParamValueFromID("hostname");
+  if (deviceName == NULL)
+    deviceName = mqtt::getClientId();
+
+  uint32_t hash = computeConfigHash();
+  if (hash == readPublishedHash())
+    return;
+  logging::getLogStream().printf("discovery: publishing the Home Assistant config (hash %08x)\n", hash);
+
+  bool ok = true;
+  if (wifi::getParamValueFromID("subMqttLightSet") != NULL && wifi::getParamValueFromID("pubMqttStatus") != NULL)
+    ok = publishEntity("switch", "relay", renderSwitch) && ok;
+  if (wifi::getParamValueFromID("pubMqttTemperature") != NULL)
+    ok = publishEntity("sensor", "temperature", renderTemperature) && ok;
+  if (wifi::getParamValueFromID("pubMqttStatus") != NULL)
+    ok = publishEntity("binary_sensor", "overheat", renderOverheat) && ok;
+  // Published again at the next connection if something failed
+  if (ok)
+    writePublishedHash(hash);
+}
+
+}
@@ -0,0 +1,14 @@
+#ifndef DISCOVERY
+#define DISCOVERY
+
+#include <Arduino.h>
+
+namespace discovery
+{
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
+  void publishConfig();
+}
+
+#endif
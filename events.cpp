@@ -0,0 +1,161 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "events.h"
+#include "scheduler.h"
+
+
+namespace events
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Server-Sent Events on /events                                        //
+// Each client has a small queue of events, drained according to what  //
+// the client can accept. A client too slow to empty its queue is closed //
+///////////////////////////////////////////////////////////////////////////
+
+#define MAX_SSE_CLIENTS     3
+#define SSE_QUEUE_SIZE      6           // Events waiting for each client
+#define SSE_EVENT_SIZE      96          // Size of a formatted event
+#define SSE_CLIENT_TIMEOUT  10000       // In ms, a client not reading during this time is closed
+#define SSE_KEEPALIVE       15000       // In ms, comment sent to detect the closed connections
+
+struct SseClient
+{
+  WiFiClient client;
+  char queue[SSE_QUEUE_SIZE][SSE_EVENT_SIZE];
+  uint8_t first;                // Oldest event in the queue
+  uint8_t count;                // Number of events in the queue
+  uint8_t sent;                 // Bytes of the oldest event already sent
+  unsigned long lastProgressTime;
+};
+SseClient sseClients[MAX_SSE_CLIENTS];
+unsigned long lastKeepAliveTime = 0;
+
+void closeClient(SseClient &c, const char* reason)
+{
+  logging::getLogStream().printf("events: closing client %s (%s)\n", helpers::ipToStr((uint32_t)c.client.remoteIP()), reason);
+  c.client.stop();
+  c.client = WiFiClient();
+  c.count = 0;
+}
+
+bool isActive(SseClient &c)
+{
+  return c.client && c.client.connected();
+}
+
+void enqueue(SseClient &c, const char* event)
+{
+  if (c.count == SSE_QUEUE_SIZE)
+  {
+    closeClient(c, "queue full");
+    return;
+  }
+  uint8_t idx = (c.first + c.count) % SSE_QUEUE_SIZE;
+  strncpy(c.queue[idx], event, SSE_EVENT_SIZE - 1);
+  c.queue[idx][SSE_EVENT_SIZE - 1] = 0x00;
+  if (c.count == 0)
+    c.lastProgressTime = millis();
+  c.count++;
+}
+
+// Send an event to all the clients, data should be a single line
+void post(const char* type, const char* data)
+{
+  char event[SSE_EVENT_SIZE];
+  snprintf(event, sizeof(event), "event: %s\ndata: %s\n\n", type, data);
+  for (uint8_t i = 0; i < MAX_SSE_CLIENTS; i++)
+    if (isActive(sseClients[i]))
+      enqueue(sseClients[i], event);
+}
+
+void handleEventsRequest()
+{
+  ESP8266WebServer *server = wifi::getWebServer();
+  for (uint8_t i = 0; i < MAX_SSE_CLIENTS; i++)
+  {
+    SseClient &c = sseClients[i];
+    if (isActive(c))
+      continue;
+    // Keep the connection of this request for the events
+    c.client = server->client();
+    c.client.setNoDelay(true);
+    c.first = 0;
+    c.count = 0;
+    c.sent = 0;
+    c.lastProgressTime = millis();
+    logging::getLogStream().printf("events: new client %s\n", helpers::ipToStr((uint32_t)c.client.remoteIP()));
+    server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server->sendContent_P(PSTR("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                               "Connection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n"));
+    return;
+  }
+  server->send(503, "text/plain", "Too many clients");
+}
+
+void bindServerCallback()
+{
+  wifi::getWebServer()->on("/events", handleEventsRequest);
+}
+
+void setup()
+{
+  scheduler::addTask("events", handle, scheduler::PRIORITY_LOW, 20, 2000);
+}
+
+void handle()
+{
+  unsigned long now = millis();
+  bool keepAlive = (now - lastKeepAliveTime > SSE_KEEPALIVE);
+  if (keepAlive)
+    lastKeepAliveTime = now;
+
+  for (uint8_t i = 0; i < MAX_SSE_CLIENTS; i++)
+  {
+    SseClient &c = sseClients[i];
+    if (!c.client)
+      continue;
+    if (!c.client.connected())
+    {
+      closeClient(c, "disconnected");
+      continue;
+    }
+    if (keepAlive && c.count == 0)
+      enqueue(c, ":\n\n");
+
+    // Send what the client can accept without waiting
+    while (c.count > 0)
+    {
+      int room = c.client.availableForWrite();
+      if (room <= 0)
+        break;
+      const char* event = c.queue[c.first];
+      size_t len = strlen(event) - c.sent;
+      if (len > (size_t)room)
+        len = room;
+      size_t written = c.client.write((const uint8_t*)event + c.sent, len);
+      if (written == 0)
+        break;
+      c.lastProgressTime = now;
+      c.sent += written;
+      if (event[c.sent] == 0x00)
+      {
+        c.first = (c.first + 1) % SSE_QUEUE_SIZE;
+        c.count--;
+        c.sent = 0;
+      }
+    }
+
+    // Evict the clients not reading their events
+    if (c.count > 0 && now - c.lastProgressTime > SSE_CLIENT_TIMEOUT)
+      closeClient(c, "too slow");
+    else if (c.count > 0)
+      scheduler::stayAwake();
+  }
+}
+
+}
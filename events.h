@@ -0,0 +1,14 @@
+#ifndef EVENTS
+#define EVENTS
+
+#include <Arduino.h>
+
+namespace events
+{
+  void post(const char* type, const char* data);
+  void bindServerCallback();
+  void setup();
+  void handle();
+}
+
+#endif
@@ -6,16 +6,27 @@
 #include "config.h"
 #include "light.h"
 #include "switches.h"
+#include "scheduler.h"
+#include "events.h"
+#include "watchdog.h"
 
 
 
 namespace light {
 
+// The light is switched by the first relay of the board
+static_assert(Board::NB_RELAYS > 0, "the board has no relay, the dimmer driven by the STM32 is not supported");
+#define LIGHT_RELAY Board::RELAY_PINS[0]
+
+const char* const paramKeys[] = {"minBrightness", "maxBrightness", "autoOffTimer", "relayMinDwell", NULL};
+
 // The light parameters
 volatile uint8_t minBrightness = 0;   // brightness values in %
 volatile uint8_t maxBrightness = 100;
 volatile uint8_t brightness = 0;
 uint8_t publishedBrightness = 0;      // The last brigthness value published to MQTT
+bool forcePublishBrightness = false;  // To publish the brightness even if it has not changed
+uint8_t postedBrightness = 0;         // The last brightness value sent to the /events clients
 uint8_t wattage = 0;
 
 // For the auto-off timer
@@ -23,6 +34,22 @@ uint16_t autoOffDuration = 0;         // In seconds
 volatile unsigned long lastLightOnTime = 0;
 volatile bool lightAutoTurnOffDisable = false;
 
+// For the command arbiter in front of the relay
+#define RATE_LIMIT_BURST    5         // Number of commands accepted in a burst from one source
+#define RATE_LIMIT_REFILL   200       // In ms, time to get back one command for a source
+uint16_t relayMinDwell = 250;         // In ms, minimum time between two changes of the relay
+volatile unsigned long lastRelayChangeTime = 0;
+volatile bool commandPending = false; // Command waiting for the end of the dwell time
+volatile bool pendingLightOn = false;
+volatile bool pendingNoLightAutoTurnOff = false;
+volatile bool pendingRateLimited = false;    // The pending command waits for its source to stop flooding
+volatile unsigned long lastRateLimitedTime = 0;
+volatile uint8_t sourceTokens[NB_SOURCES] = {0};
+volatile unsigned long sourceRefillTime[NB_SOURCES] = {0};
+volatile uint32_t commandsApplied = 0;
+volatile uint32_t commandsMerged = 0;
+volatile uint32_t commandsDropped[NB_SOURCES] = {0};   // Rate limited, only their final state is applied
+
 // For blinking
 unsigned long startBlinkingTime = 0;
 uint16_t blinkingTimerDuration = 5;  // In seconds
@@ -30,6 +57,7 @@ bool blinking = false;
 
 // For the blinking pattern
 unsigned long lastBlinkingLightStateTime = 0;
+unsigned long nextBlinkingChangeTime = 0;   // Time of the next on/off change for the blinking
 bool blinkingLightState = false;
 uint16_t blinkingPattern[10] = {500, 500, 0, 0, 0, 0, 0, 0, 0, 0};   // in ms; if 0, no blinking
 
@@ -39,6 +67,26 @@ uint8_t &getWattage() {
   return wattage;
 }
 
+uint32_t getCommandsApplied() {
+  return commandsApplied;
+}
+
+uint32_t getCommandsMerged() {
+  return commandsMerged;
+}
+
+uint32_t getCommandsDropped(uint8_t source) {
+  return (source < NB_SOURCES) ? commandsDropped[source] : 0;
+}
+
+void printCommandStats()
+{
+  logging::getLogStream().printf("light: commands applied %u, merged %u, rate limited (switch %u, mqtt %u, http %u, telnet %u, udp %u, rules %u, schedule %u)\n",
+                                 commandsApplied, commandsMerged, commandsDropped[SOURCE_SWITCH], commandsDropped[SOURCE_MQTT],
+                                 commandsDropped[SOURCE_HTTP], commandsDropped[SOURCE_TELNET], commandsDropped[SOURCE_UDP],
+                                 commandsDropped[SOURCE_RULES], commandsDropped[SOURCE_SCHEDULE]);
+}
+
 void STM32reset()
 {
 }
@@ -145,14 +193,24 @@ void mqttCallback(const char* paramID, const char* payload)
 {
   if (strcmp(paramID, "subMqttLightOn") == 0 || strcmp(paramID, "subMqttLightAllOn") == 0)
   {
-    lightOn();
+    lightOn(false, SOURCE_MQTT);
   }
   else if (strcmp(paramID, "subMqttLightToggle") == 0)
   {
-    lightToggle();
+    lightToggle(false, SOURCE_MQTT);
   }
   else if (strcmp(paramID, "subMqttLightOff") == 0 || strcmp(paramID, "subMqttLightAllOff") == 0)
-    lightOff();
+    lightOff(SOURCE_MQTT);
+  else if (strcmp(paramID, "subMqttLightSet") == 0)
+  {
+    // Single topic with the state in the payload, as used by Home Assistant
+    if (strcmp(payload, "ON") == 0)
+      lightOn(false, SOURCE_MQTT);
+    else if (strcmp(payload, "OFF") == 0)
+      lightOff(SOURCE_MQTT);
+    else if (strcmp(payload, "TOGGLE") == 0)
+      lightToggle(false, SOURCE_MQTT);
+  }
   else if (strcmp(paramID, "subMqttBlinkingPattern") == 0)
   {
     setBlinkingPattern(payload);
@@ -165,6 +223,11 @@ void mqttCallback(const char* paramID, const char* payload)
   }
 }
 
+void republishState()
+{
+  forcePublishBrightness = true;
+}
+
 void sendCmdGetVersion()
 {
 }
@@ -217,35 +280,18 @@ void setBrightness(uint8_t b)
 {
 }
 
-ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff)
-{
-  //logging::getLogStream().printf("light: switch on\n");
-  if (noLightAutoTurnOff==true)
-  {
-    lightAutoTurnOffDisable =true;
-    lastLightOnTime=0;
-  }
-  else
-    // Reset auto turn off timer
-    lastLightOnTime=millis();
-  digitalWrite(LIGHT_RELAY, HIGH);
-  brightness = maxBrightness;
-}
-
-ICACHE_RAM_ATTR void lightOff()
+ICACHE_RAM_ATTR bool lightIsOn()
 {
-  //logging::getLogStream().printf("light: switch off\n");
-  lastLightOnTime = 0;
-  lightAutoTurnOffDisable =false;
-  digitalWrite(LIGHT_RELAY, LOW);
-  brightness = minBrightness;
+  return brightness != minBrightness;
 }
 
-ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff)
+// Switch the relay, after the arbiter has accepted the command
+ICACHE_RAM_ATTR void applyLightState(bool on, bool noLightAutoTurnOff)
 {
-  // If brighness different from minBrightness
-  if (brightness == minBrightness)
+  bool changed = (on != lightIsOn());
+  if (on)
   {
+    //logging::getLogStream().printf("light: switch on\n");
     if (noLightAutoTurnOff==true)
     {
       lightAutoTurnOffDisable =true;
@@ -254,30 +300,138 @@ ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff)
     else
       // Reset auto turn off timer
       lastLightOnTime=millis();
-
-    // Switch on the light
     digitalWrite(LIGHT_RELAY, HIGH);
     brightness = maxBrightness;
   }
   else
   {
-    // Set the timer to 0
+    //logging::getLogStream().printf("light: switch off\n");
     lastLightOnTime = 0;
     lightAutoTurnOffDisable =false;
-    // Switch off te light
     digitalWrite(LIGHT_RELAY, LOW);
     brightness = minBrightness;
   }
+  if (changed)
+  {
+    watchdog::breadcrumb(watchdog::CRUMB_RELAY, on ? 1 : 0);
+    lastRelayChangeTime = millis();
+    commandsApplied++;
+  }
 }
 
-ICACHE_RAM_ATTR bool lightIsOn()
+// Rate limit for each source with a token bucket, the internal commands are never limited
+ICACHE_RAM_ATTR bool acceptCommand(uint8_t source, unsigned long now)
 {
-  return brightness != minBrightness;
+  if (source == SOURCE_INTERNAL || source >= NB_SOURCES)
+    return true;
+  unsigned long nbRefill = (now - sourceRefillTime[source]) / RATE_LIMIT_REFILL;
+  if (nbRefill > 0)
+  {
+    if (sourceTokens[source] + nbRefill >= RATE_LIMIT_BURST)
+    {
+      sourceTokens[source] = RATE_LIMIT_BURST;
+      sourceRefillTime[source] = now;
+    }
+    else
+    {
+      sourceTokens[source] += nbRefill;
+      sourceRefillTime[source] += nbRefill * RATE_LIMIT_REFILL;
+    }
+  }
+  if (sourceTokens[source] == 0)
+  {
+    commandsDropped[source]++;
+    return false;
+  }
+  sourceTokens[source]--;
+  return true;
+}
+
+// Command arbiter in front of the relay
+// A command arriving before the minimum dwell time since the last relay change is kept pending,
+// the following ones are merged with it and only the final state is applied once the dwell time has elapsed
+ICACHE_RAM_ATTR void arbitrateLightState(bool on, bool noLightAutoTurnOff, uint8_t source)
+{
+  unsigned long now = millis();
+  if (!acceptCommand(source, now))
+  {
+    // The relay does not follow the flood, but the last requested state is applied once it has stopped
+    pendingLightOn = on;
+    pendingNoLightAutoTurnOff = noLightAutoTurnOff;
+    pendingRateLimited = true;
+    lastRateLimitedTime = now;
+    commandPending = true;
+    return;
+  }
+  if (commandPending)
+  {
+    commandsMerged++;
+    pendingLightOn = on;
+    pendingNoLightAutoTurnOff = noLightAutoTurnOff;
+  }
+  else if (on == lightIsOn() || now - lastRelayChangeTime >= relayMinDwell)
+    applyLightState(on, noLightAutoTurnOff);
+  else
+  {
+    pendingLightOn = on;
+    pendingNoLightAutoTurnOff = noLightAutoTurnOff;
+    commandPending = true;
+  }
+}
+
+// The switches call the arbiter from the timer ISR, the interrupts are masked when it runs from the loop.
+// The previous level is restored, instead of interrupts(), for the calls from the ISR
+ICACHE_RAM_ATTR void requestLightState(bool on, bool noLightAutoTurnOff, uint8_t source)
+{
+  uint32_t savedPS = xt_rsil(15);
+  arbitrateLightState(on, noLightAutoTurnOff, source);
+  xt_wsr_ps(savedPS);
+}
+
+ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff, uint8_t source)
+{
+  requestLightState(true, noLightAutoTurnOff, source);
+}
+
+ICACHE_RAM_ATTR void lightOff(uint8_t source)
+{
+  requestLightState(false, false, source);
+}
+
+ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff, uint8_t source)
+{
+  // Toggle the state that will be applied, not the current state of the relay
+  uint32_t savedPS = xt_rsil(15);
+  bool on = commandPending ? pendingLightOn : lightIsOn();
+  arbitrateLightState(!on, noLightAutoTurnOff, source);
+  xt_wsr_ps(savedPS);
+}
+
+// Time in ms before the next change of the relay: pending command, blinking or auto-off
+uint32_t getTimeToNextDeadline()
+{
+  unsigned long now = millis();
+  uint32_t deadline = 0xFFFFFFFF;
+  if (commandPending)
+  {
+    deadline = (now - lastRelayChangeTime >= relayMinDwell) ? 0 : relayMinDwell - (now - lastRelayChangeTime);
+    if (pendingRateLimited && now - lastRateLimitedTime < RATE_LIMIT_REFILL)
+      deadline = max(deadline, (uint32_t)(RATE_LIMIT_REFILL - (now - lastRateLimitedTime)));
+  }
+  if (blinking)
+    deadline = min(deadline, (uint32_t)((long)(nextBlinkingChangeTime - now) > 0 ? nextBlinkingChangeTime - now : 0));
+  if (autoOffDuration > 0 && lastLightOnTime > 0)
+  {
+    unsigned long elapsed = now - lastLightOnTime;
+    deadline = min(deadline, (uint32_t)(elapsed >= autoOffDuration * 1000UL ? 0 : autoOffDuration * 1000UL - elapsed));
+  }
+  return deadline;
 }
 
 void setup()
 {
   pinMode(LIGHT_RELAY, OUTPUT);
+  scheduler::addTask("light", handle, scheduler::PRIORITY_HIGH, 0, 500, getTimeToNextDeadline);
 }
 
 void updateParams()
@@ -286,6 +440,9 @@ void updateParams()
   setMinBrightness(wifi::getParamValueFromID("minBrightness"));
   setMaxBrightness(wifi::getParamValueFromID("maxBrightness"));
   setAutoOffTimer(wifi::getParamValueFromID("autoOffTimer"));
+  uint16_t dwell = 250;
+  helpers::convertToInteger(wifi::getParamValueFromID("relayMinDwell"), dwell, 5);
+  relayMinDwell = dwell;
 }
 
 void addWifiManagerCustomButtons()
@@ -299,20 +456,20 @@ void addWifiManagerCustomParams()
 void bindServerCallback()
 {
   // HTTP callback for controling the light
-  wifi::getWifiManager().server.get()->on("/on", []()
+  wifi::getWebServer()->on("/on", []()
                                 {
                                   // Light on
-                                  lightOn();
+                                  lightOn(false, SOURCE_HTTP);
                                   // Send OK text
-                                  wifi::getWifiManager().server.get()->send ( 200, "text/plain", "Ok");
+                                  wifi::getWebServer()->send ( 200, "text/plain", "Ok");
                                 }
                               );
-  wifi::getWifiManager().server.get()->on("/off", []()
+  wifi::getWebServer()->on("/off", []()
                                 {
                                   // Light off
-                                  lightOff();
+                                  lightOff(SOURCE_HTTP);
                                   // Send OK text
-                                  wifi::getWifiManager().server.get()->send ( 200, "text/plain", "Ok");
+                                  wifi::getWebServer()->send ( 200, "text/plain", "Ok");
                                 }
                               );
 }
@@ -321,8 +478,33 @@ void handle()
 {
   unsigned long currTime;
 
+  // Apply the pending command once the dwell time has elapsed, and after a rate limited command
+  // once its source has not sent any other for the refill time
+  if (commandPending && millis() - lastRelayChangeTime >= relayMinDwell &&
+      (!pendingRateLimited || millis() - lastRateLimitedTime >= RATE_LIMIT_REFILL))
+  {
+    // The ISR can change the pending command or switch the relay until it is applied
+    uint32_t savedPS = xt_rsil(15);
+    if (commandPending)
+    {
+      commandPending = false;
+      pendingRateLimited = false;
+      applyLightState(pendingLightOn, pendingNoLightAutoTurnOff);
+    }
+    xt_wsr_ps(savedPS);
+  }
+
+  // Send the new brightness value to the /events clients
+  if (postedBrightness != brightness)
+  {
+    char data[40];
+    postedBrightness = brightness;
+    sprintf(data, "{\"light\":\"%s\",\"brightness\":%d}", lightIsOn() ? "ON" : "OFF", postedBrightness);
+    events::post("light", data);
+  }
+
   // Check if there is new brightness value to publish
-  if (publishedBrightness != brightness)
+  if (publishedBrightness != brightness || forcePublishBrightness)
   {
     // Publish the new value of the brightness
     const char* topic = wifi::getParamValueFromID("pubMqttBrightnessLevel");
@@ -330,10 +512,22 @@ void handle()
     if (topic != NULL)
     {
       char payload[5];
-      sprintf(payload, "%d", brightness);
-      if (mqtt::publishMQTT(topic, payload))
+      snprintf(payload, sizeof(payload), "%d", brightness);
+      // Retained so that a new subscriber gets the state immediately
+      if (mqtt::publishMQTT(topic, payload, true))
+      {
         // If the new brightness value has been succeefully published
         publishedBrightness = brightness;
+        forcePublishBrightness = false;
+        mqtt::publishStatus();
+      }
+    }
+    else
+    {
+      forcePublishBrightness = false;
+      // The state of the light is still given by the status
+      if (mqtt::publishStatus())
+        publishedBrightness = brightness;
     }
   }
 
@@ -371,6 +565,7 @@ void handle()
         pc++;
       }
       
+      nextBlinkingChangeTime = currTime + (sum - diff);
       bool newBlinkingLightState = ((pc-1)%2==0);
       if (blinkingLightState != newBlinkingLightState)
       {
@@ -12,19 +12,30 @@
 
 namespace light 
 {
+  // The sources of the commands for the relay
+  enum { SOURCE_INTERNAL, SOURCE_SWITCH, SOURCE_MQTT, SOURCE_HTTP, SOURCE_TELNET, SOURCE_UDP, SOURCE_RULES, SOURCE_SCHEDULE, NB_SOURCES };
+
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
   // getter
   uint8_t &getWattage();
+  uint32_t getCommandsApplied();
+  uint32_t getCommandsMerged();
+  uint32_t getCommandsDropped(uint8_t source);
+  void printCommandStats();
 
   void mqttCallback(const char* paramID, const char* payload);
+  void republishState();
 
   void setMinBrightness(const char* str);
   void setMaxBrightness(const char* str);
   void setDimmingParameters(const char* dimmingTypeStr, const char* debounceStr);
 
   void setBrightness(uint8_t b);
-  ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff=false);
-  ICACHE_RAM_ATTR void lightOff();
-  ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff=false);
+  ICACHE_RAM_ATTR void lightOn(bool noLightAutoTurnOff=false, uint8_t source=SOURCE_INTERNAL);
+  ICACHE_RAM_ATTR void lightOff(uint8_t source=SOURCE_INTERNAL);
+  ICACHE_RAM_ATTR void lightToggle(bool noLightAutoTurnOff=false, uint8_t source=SOURCE_INTERNAL);
   ICACHE_RAM_ATTR bool lightIsOn();
 
   void STM32reset();
@@ -35,6 +46,7 @@ namespace light
   void setBlinkingPattern(const char *payload);
   void startBlinking();
   void stopBlinking();
+  uint32_t getTimeToNextDeadline();
   void setup();
   void handle();
   void updateParams();
@@ -2,19 +2,43 @@
 
 #include <ESP8266WiFi.h>
 #include <LittleFS.h>
+#include <new>
 
 #include "config.h"
 #include "wifi.h"
 #include "light.h"
 #include "switches.h"
+#include "schedule.h"
+#include "scheduler.h"
+#include "metrics.h"
 
 namespace logging
 {
 
+const char* const paramKeys[] = {"logOutput", NULL};
+
 // Telent server for logging and debugging
+#define MAX_TELNET_CLIENTS 3              // Number of simultaneous telnet viewers
+#define TELNET_RING_SIZE   2048           // Must be a power of two
+#define TELNET_CMD_SIZE    40
 WiFiServer *TelnetServer = NULL;    // (23)
-WiFiClient Telnet;
+WiFiClient telnetClients[MAX_TELNET_CLIENTS];
+#ifdef STATIC_ALLOCATION
+// The server is built at the first use, then only started and stopped
+alignas(WiFiServer) uint8_t telnetServerStorage[sizeof(WiFiServer)];
+WiFiServer *staticTelnetServer = NULL;
+char telnetCmdStorage[TELNET_CMD_SIZE];
+char *telnetCmd = telnetCmdStorage;
+#else
 char *telnetCmd = NULL;
+#endif
+
+// Ring buffer decoupling the log output from the telnet clients
+// The head counts all the bytes ever written, each client keeps its own read position
+char telnetRing[TELNET_RING_SIZE];
+volatile uint32_t telnetRingHead = 0;
+uint32_t telnetClientPos[MAX_TELNET_CLIENTS] = {0};
+uint32_t telnetDroppedBytes = 0;          // Bytes overwritten before being sent to a client
 
 //////////////////////////////////////////////////////////////////////
 // A class to handle logging                                        //
@@ -42,6 +66,29 @@ void LogStream::setLogOutput(const char *c)
   }
 }
 
+// Copy data into the telnet ring buffer. It never blocks: when the buffer is full,
+// the oldest data is overwritten and the lagging clients get a "bytes dropped" marker
+// The interrupts are masked during the copy since an ISR can log while the loop is writing.
+// The previous level is restored, instead of interrupts(), for the calls from an ISR
+ICACHE_RAM_ATTR size_t writeToTelnetRing(const uint8_t *buffer, size_t size)
+{
+  uint32_t savedPS = xt_rsil(15);
+  uint32_t head = telnetRingHead;
+  for (size_t i = 0; i < size; i++)
+  {
+    telnetRing[head & (TELNET_RING_SIZE - 1)] = buffer[i];
+    head++;
+  }
+  telnetRingHead = head;
+  xt_wsr_ps(savedPS);
+  return size;
+}
+
+uint32_t getTelnetDroppedBytes()
+{
+  return telnetDroppedBytes;
+}
+
 size_t LogStream::write(uint8_t data)
 {
   size_t tmp = 0;
@@ -51,7 +98,7 @@ size_t LogStream::write(uint8_t data)
     case LogToSerial:
       return Serial.write(data);
     case LogToTelnet:
-      return Telnet.write(data);
+      return writeToTelnetRing(&data, 1);
     case LogToFile:
       logFile = LittleFS.open("/log.txt", "a");
       if (logFile)
@@ -64,6 +111,29 @@ size_t LogStream::write(uint8_t data)
       return 0;
   }
 }
+size_t LogStream::write(const uint8_t *buffer, size_t size)
+{
+  size_t tmp = 0;
+  File logFile;
+  switch (logOutput)
+  {
+    case LogToSerial:
+      return Serial.write(buffer, size);
+    case LogToTelnet:
+      return writeToTelnetRing(buffer, size);
+    case LogToFile:
+      // Open the file only once for the whole buffer
+      logFile = LittleFS.open("/log.txt", "a");
+      if (logFile)
+      {
+        tmp = logFile.write(buffer, size);
+        logFile.close();
+      }
+      return tmp;
+    default:
+      return 0;
+  }
+}
 int LogStream::availableForWrite()
 {
   switch (logOutput)
@@ -71,7 +141,8 @@ int LogStream::availableForWrite()
     case LogToSerial:
       return Serial.availableForWrite();
     case LogToTelnet:
-      return Telnet.availableForWrite();
+      // The ring buffer always accepts data
+      return TELNET_RING_SIZE;
   }
   return 0;
 }
@@ -98,7 +169,7 @@ void LogStream::flush()
       Serial.flush();
       break;
     case LogToTelnet:
-      Telnet.flush();
+      // Never wait for the telnet clients, the ring buffer is drained in handle()
       break;
   }
 }
@@ -112,52 +183,106 @@ LogStream &getLogStream() {
 //////////////////////
 // Telnet functions //
 //////////////////////
-char* readTelnetCmd()
+void acceptTelnetClients()
 {
-  if (!TelnetServer)
-    return NULL;
+  if (!TelnetServer->hasClient())
+    return;
+  for (uint8_t i = 0; i < MAX_TELNET_CLIENTS; i++)
+  {
+    if (!telnetClients[i] || !telnetClients[i].connected())
+    {
+      if (telnetClients[i])
+        telnetClients[i].stop();         // client disconnected
+      telnetClients[i] = TelnetServer->available(); // ready for new client
+      // Start with the history still available in the ring buffer
+      uint32_t head = telnetRingHead;
+      telnetClientPos[i] = (head > TELNET_RING_SIZE) ? head - TELNET_RING_SIZE : 0;
+      return;
+    }
+  }
+  TelnetServer->available().stop();  // all the slots are used, block new connections
+}
 
-  // Handle for the telnet
-  if (TelnetServer->hasClient())
+// Send the content of the ring buffer to the clients, without writing more than what
+// each client can accept so that a slow client never blocks the loop
+void drainTelnetRing()
+{
+  uint32_t head = telnetRingHead;
+  for (uint8_t i = 0; i < MAX_TELNET_CLIENTS; i++)
   {
-    // client is connected
-    if (!(Telnet) || !Telnet.connected())
+    WiFiClient &client = telnetClients[i];
+    if (!client || !client.connected())
+      continue;
+    uint32_t pos = telnetClientPos[i];
+    if (head - pos > TELNET_RING_SIZE)
     {
-      if (Telnet)
-        Telnet.stop();         // client disconnected
-      Telnet = TelnetServer->available(); // ready for new client
+      // The oldest data for this client has been overwritten
+      char marker[32];
+      uint32_t dropped = head - TELNET_RING_SIZE - pos;
+      int len = snprintf(marker, sizeof(marker), "\r\n[%u bytes dropped]\r\n", (unsigned int)dropped);
+      if (client.availableForWrite() < len)
+        continue;
+      client.write((const uint8_t*)marker, len);
+      telnetDroppedBytes += dropped;
+      pos = head - TELNET_RING_SIZE;
     }
-    else
+    while (pos != head)
     {
-      TelnetServer->available().stop();  // have client, block new connections
+      int room = client.availableForWrite();
+      if (room <= 0)
+        break;
+      uint32_t offset = pos & (TELNET_RING_SIZE - 1);
+      uint32_t len = head - pos;
+      if (len > TELNET_RING_SIZE - offset)
+        len = TELNET_RING_SIZE - offset;
+      if (len > (uint32_t)room)
+        len = room;
+      size_t sent = client.write((const uint8_t*)&telnetRing[offset], len);
+      if (sent == 0)
+        break;
+      pos += sent;
     }
+    telnetClientPos[i] = pos;
   }
+}
 
-  const uint8_t MAXBUFFERSIZE = 40;
-  if (Telnet && Telnet.connected() && Telnet.available())
-  {
-    char c;
-    uint8_t charsReceived = 0;
-    if (telnetCmd == NULL)
-      telnetCmd = (char*)calloc(sizeof(char), MAXBUFFERSIZE);
-    memset(telnetCmd,0x00,sizeof(char)*MAXBUFFERSIZE);
+char* readTelnetCmd()
+{
+  if (!TelnetServer)
+    return NULL;
 
-    // copy waiting characters into textBuff
-    //until textBuff full, CR received, or no more characters
-    while (Telnet.available() && charsReceived < MAXBUFFERSIZE && c != 0x0d)
-    {
-      c = Telnet.read();
-      telnetCmd[charsReceived] = c;
-      charsReceived++;
-    }
-    // Skip new line feed
-    if (charsReceived == 1 && telnetCmd[0] == 10)
-      return NULL;
-    if (charsReceived > 0)
+  // Handle for the telnet
+  acceptTelnetClients();
+
+  const uint8_t MAXBUFFERSIZE = TELNET_CMD_SIZE;
+  for (uint8_t i = 0; i < MAX_TELNET_CLIENTS; i++)
+  {
+    WiFiClient &Telnet = telnetClients[i];
+    if (Telnet && Telnet.connected() && Telnet.available())
     {
-      if (charsReceived < MAXBUFFERSIZE)
-        telnetCmd[charsReceived]=0x00;
-      return telnetCmd;
+      char c = 0x00;
+      uint8_t charsReceived = 0;
+      if (telnetCmd == NULL)
+        telnetCmd = (char*)calloc(sizeof(char), MAXBUFFERSIZE);
+      memset(telnetCmd,0x00,sizeof(char)*MAXBUFFERSIZE);
+
+      // copy waiting characters into textBuff
+      //until textBuff full, CR received, or no more characters
+      while (Telnet.available() && charsReceived < MAXBUFFERSIZE && c != 0x0d)
+      {
+        c = Telnet.read();
+        telnetCmd[charsReceived] = c;
+        charsReceived++;
+      }
+      // Skip new line feed
+      if (charsReceived == 1 && telnetCmd[0] == 10)
+        continue;
+      if (charsReceived > 0)
+      {
+        if (charsReceived < MAXBUFFERSIZE)
+          telnetCmd[charsReceived]=0x00;
+        return telnetCmd;
+      }
     }
   }
   return NULL;
@@ -165,20 +290,32 @@ char* readTelnetCmd()
 
 void printTelnetMenu()
 {
-  // Print the telnet menu
-  if (Telnet)
+  // Print the telnet menu, it goes through the ring buffer like the logs
+  // The strings stay in flash
+  if (TelnetServer)
   {
-    Telnet.println("Commands:");
-    Telnet.println(" br000 to br100 : set the brightness between 0% and 100%");
-    Telnet.println(" on or off : switch on/off the light");
-    Telnet.println(" temp : enable/disable temperature logging and overheating alarm");
-    Telnet.println(" blpt xxx xxx xxx : set blinking pattern");
-    Telnet.println(" sab : start blinking");
-    Telnet.println(" sob : stop blinking");
-    Telnet.println(" bldu : set the blinking duration");
+    logStream.println(F("Commands:"));
+    logStream.println(F(" br000 to br100 : set the brightness between 0% and 100%"));
+    logStream.println(F(" on or off : switch on/off the light"));
+    logStream.println(F(" cmds : show the counters of the relay commands"));
+    logStream.println(F(" time : show the clock and the next scheduled entry"));
+    logStream.println(F(" tasks : show the statistics of the tasks"));
+    logStream.println(F(" heap : show the heap and stack metrics"));
+    logStream.println(F(" portal : start the configuration portal"));
+    logStream.println(F(" temp : enable/disable temperature logging and overheating alarm"));
+    logStream.println(F(" blpt xxx xxx xxx : set blinking pattern"));
+    logStream.println(F(" sab : start blinking"));
+    logStream.println(F(" sob : stop blinking"));
+    logStream.println(F(" bldu : set the blinking duration"));
   }
 }
 
+void setup()
+{
+  // The telnet commands and the logs are less urgent than the switches
+  scheduler::addTask("telnet", handle, scheduler::PRIORITY_LOW, 0, 3000);
+}
+
 void handle()
 {
   char* telnetCmd = readTelnetCmd();
@@ -195,9 +332,19 @@ void handle()
         logging::getLogStream().printf("wrong value for the brightness: %d\n", v);
     }
     else if (telnetCmd[0] == 'o' && telnetCmd[1] == 'n' && telnetCmd[2] == 0x0D)
-      light::lightOn();
+      light::lightOn(false, light::SOURCE_TELNET);
     else if (telnetCmd[0] == 'o' && telnetCmd[1] == 'f' && telnetCmd[2] == 'f' && telnetCmd[3] == 0x0D)
-      light::lightOff();
+      light::lightOff(light::SOURCE_TELNET);
+    else if (telnetCmd[0] == 'c' && telnetCmd[1] == 'm' && telnetCmd[2] == 'd' && telnetCmd[3] == 's' && telnetCmd[4] == 0x0D)
+      light::printCommandStats();
+    else if (telnetCmd[0] == 't' && telnetCmd[1] == 'i' && telnetCmd[2] == 'm' && telnetCmd[3] == 'e' && telnetCmd[4] == 0x0D)
+      schedule::printClock();
+    else if (telnetCmd[0] == 't' && telnetCmd[1] == 'a' && telnetCmd[2] == 's' && telnetCmd[3] == 'k' && telnetCmd[4] == 's' && telnetCmd[5] == 0x0D)
+      scheduler::printStats();
+    else if (telnetCmd[0] == 'h' && telnetCmd[1] == 'e' && telnetCmd[2] == 'a' && telnetCmd[3] == 'p' && telnetCmd[4] == 0x0D)
+      metrics::printHeap();
+    else if (telnetCmd[0] == 'p' && telnetCmd[1] == 'o' && telnetCmd[2] == 'r' && telnetCmd[3] == 't' && telnetCmd[4] == 'a' && telnetCmd[5] == 'l' && telnetCmd[6] == 0x0D)
+      wifi::requestPortal();
     else if (telnetCmd[0] == 't' && telnetCmd[1] == 'e'&& telnetCmd[2] == 'm' && telnetCmd[3] == 'p' && telnetCmd[4] == 0x0D)
       switches::getTemperatureLogging()=!switches::getTemperatureLogging();
     else if (telnetCmd[0] == 'r' && telnetCmd[1] == 'e' && telnetCmd[2] == 's' && telnetCmd[3] == 0x0D)
@@ -214,6 +361,10 @@ void handle()
       // Command not recognized command, we print the menu options
       printTelnetMenu();
   }
+
+  // Send the pending logs to the telnet clients
+  if (TelnetServer)
+    drainTelnetRing();
 }
 
 void enableTelnet()
@@ -221,7 +372,13 @@ void enableTelnet()
   if (TelnetServer == NULL)
   {
     logStream.println("Starting telnet server");
+    #ifdef STATIC_ALLOCATION
+    if (staticTelnetServer == NULL)
+      staticTelnetServer = new (telnetServerStorage) WiFiServer(23);
+    TelnetServer = staticTelnetServer;
+    #else
     TelnetServer = new WiFiServer(23);
+    #endif
     TelnetServer->begin();
   }
 }
@@ -231,18 +388,23 @@ void disableTelnet()
   if (TelnetServer)
   {
     logStream.println("Stopping telnet server");
-    if (Telnet)
-      Telnet.stop();         // client disconnected
+    for (uint8_t i = 0; i < MAX_TELNET_CLIENTS; i++)
+      if (telnetClients[i])
+        telnetClients[i].stop();         // client disconnected
     TelnetServer->close();
     TelnetServer->stop();
 
+    #ifndef STATIC_ALLOCATION
     delete TelnetServer;
+    #endif
     TelnetServer = NULL;
+    #ifndef STATIC_ALLOCATION
     if (telnetCmd)
     {
       free(telnetCmd);
       telnetCmd = NULL;
     }
+    #endif
   }
 }
 
@@ -280,12 +442,12 @@ void waitForTelnetClient()
   while (i < 40)
   {
     // If already client connected
-    if (Telnet && Telnet.connected())
+    if (telnetClients[0] && telnetClients[0].connected())
       break;
     else if (TelnetServer->hasClient())
     {
       // If a client is waiting, we accept him
-      Telnet = TelnetServer->available(); // ready for new client
+      acceptTelnetClients();
       break;
     }
     delay(1000);
@@ -15,6 +15,8 @@ namespace logging
       LogStream();
       void setLogOutput(const char *c);
       virtual size_t write(uint8_t data);
+      virtual size_t write(const uint8_t *buffer, size_t size);
+      using Print::write;
       virtual int availableForWrite();
       virtual int available();
       virtual int read();
@@ -26,10 +28,15 @@ namespace logging
   
   LogStream &getLogStream();
 
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
   char* handleTelnet();
   void enableTelnet();
   void disableTelnet();
   void printTelnetMenu();
+  // Bytes of the log overwritten in the ring buffer before being sent to a telnet client
+  uint32_t getTelnetDroppedBytes();
 
   void eraseLogFile();
 
@@ -0,0 +1,255 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "mqtt.h"
+#include "events.h"
+#include "scheduler.h"
+#include "watchdog.h"
+#include "metrics.h"
+
+
+namespace metrics
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Heap and stack instrumentation                                        //
+// The heap is sampled every second to keep the low-water marks since   //
+// boot. The stack high-water mark comes from the core, which paints the //
+// stack of the loop at boot and looks for the deepest overwritten word  //
+// The alarm is raised when the largest free block is below heapAlarm,  //
+// before the fragmentation makes the allocations fail                  //
+///////////////////////////////////////////////////////////////////////////
+
+#define SAMPLE_PERIOD   1000          // In ms
+#define ALARM_HYSTERESIS 512          // In bytes, to clear the alarm
+
+const char* const paramKeys[] = {"heapAlarm", "metricsInterval", "pubMqttMetrics", NULL};
+
+struct Sample
+{
+  uint32_t freeHeap;
+  uint32_t maxFreeBlock;
+  uint8_t fragmentation;          // In %
+  uint32_t freeStack;             // Never used since boot
+};
+Sample last;
+uint32_t minFreeHeap = 0xFFFFFFFF;
+uint32_t minMaxFreeBlock = 0xFFFFFFFF;
+uint8_t maxFragmentation = 0;
+uint32_t samples = 0;
+
+uint16_t heapAlarm = 4096;                // In bytes, 0 to disable the alarm
+uint16_t metricsInterval = 60;            // In s, 0 to disable the publication
+bool heapAlarmOn = false;
+unsigned long lastPublishTime = 0;
+
+#ifdef ALLOCATION_COUNTER
+// The allocations counted at the allocator, so that new, String and the libraries are all seen
+volatile uint32_t allocations = 0;
+uint32_t lastAllocations = 0;
+uint32_t allocationsInLastPeriod = 0;
+uint32_t bootAllocations = 0;             // Done before the first pass of the loop
+bool booted = false;
+
+}
+
+// The linker sends the calls to malloc, calloc and realloc to these wrappers
+extern "C"
+{
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+
+  void* __wrap_malloc(size_t size)
+  {
+    metrics::allocations++;
+    return __real_malloc(size);
+  }
+
+  void* __wrap_calloc(size_t count, size_t size)
+  {
+    metrics::allocations++;
+    return __real_calloc(count, size);
+  }
+
+  void* __wrap_realloc(void* ptr, size_t size)
+  {
+    metrics::allocations++;
+    return __real_realloc(ptr, size);
+  }
+}
+
+namespace metrics
+{
+#endif
+
+uint32_t getMinFreeHeap()
+{
+  return minFreeHeap;
+}
+
+uint32_t getMinMaxFreeBlock()
+{
+  return minMaxFreeBlock;
+}
+
+bool getHeapAlarm()
+{
+  return heapAlarmOn;
+}
+
+void takeSample()
+{
+  last.freeHeap = ESP.getFreeHeap();
+  last.maxFreeBlock = ESP.getMaxFreeBlockSize();
+  last.fragmentation = ESP.getHeapFragmentation();
+  last.freeStack = ESP.getFreeContStack();
+  if (last.freeHeap < minFreeHeap)
+    minFreeHeap = last.freeHeap;
+  if (last.maxFreeBlock < minMaxFreeBlock)
+    minMaxFreeBlock = last.maxFreeBlock;
+  if (last.fragmentation > maxFragmentation)
+    maxFragmentation = last.fragmentation;
+  samples++;
+  #ifdef ALLOCATION_COUNTER
+  allocationsInLastPeriod = allocations - lastAllocations;
+  lastAllocations = allocations;
+  #endif
+}
+
+#ifdef ALLOCATION_COUNTER
+// Called at each period of the task, the first one is after the setup of all the modules
+void checkAllocations()
+{
+  if (!booted)
+  {
+    booted = true;
+    bootAllocations = allocations;
+    logging::getLogStream().printf("metrics: %u allocations during the boot\n", bootAllocations);
+  }
+  else if (allocationsInLastPeriod > 0)
+    logging::getLogStream().printf("metrics: %u allocations in the last period, %u since the boot\n",
+                                   allocationsInLastPeriod, allocations - bootAllocations);
+}
+#endif
+
+void printHeap()
+{
+  takeSample();
+  logging::getLogStream().printf("metrics: heap free %u (min %u), max block %u (min %u), fragmentation %u%% (max %u%%), stack free %u, alarm %s\n",
+                                 last.freeHeap, minFreeHeap, last.maxFreeBlock, minMaxFreeBlock,
+                                 last.fragmentation, maxFragmentation, last.freeStack, heapAlarmOn ? "on" : "off");
+  #ifdef ALLOCATION_COUNTER
+  logging::getLogStream().printf("metrics: %u allocations during the boot, %u since, %u in the last period\n",
+                                 bootAllocations, allocations - bootAllocations, allocationsInLastPeriod);
+  #endif
+}
+
+void publishMetrics()
+{
+  const char* topic = wifi::getParamValueFromID("pubMqttMetrics");
+  if (topic == NULL || !mqtt::isConnected())
+    return;
+  char payload[192];
+  snprintf(payload, sizeof(payload), "{\"freeHeap\":%u,\"minFreeHeap\":%u,\"maxFreeBlock\":%u,\"minMaxFreeBlock\":%u,"
+                                     "\"fragmentation\":%u,\"freeStack\":%u,\"alarm\":%s}",
+           last.freeHeap, minFreeHeap, last.maxFreeBlock, minMaxFreeBlock, last.fragmentation, last.freeStack,
+           heapAlarmOn ? "true" : "false");
+  mqtt::publishMQTT(topic, payload);
+}
+
+void checkAlarm()
+{
+  if (heapAlarm == 0)
+    return;
+  bool alarm = heapAlarmOn ? (last.maxFreeBlock < heapAlarm + ALARM_HYSTERESIS) : (last.maxFreeBlock < heapAlarm);
+  if (alarm == heapAlarmOn)
+    return;
+  heapAlarmOn = alarm;
+  logging::getLogStream().printf("metrics: heap alarm %s, max block %u, fragmentation %u%%\n",
+                                 heapAlarmOn ? "on" : "off", last.maxFreeBlock, last.fragmentation);
+  if (heapAlarmOn)
+    watchdog::breadcrumb(watchdog::CRUMB_HEAP_LOW, last.maxFreeBlock);
+  char data[48];
+  snprintf(data, sizeof(data), "{\"heap\":%s,\"maxFreeBlock\":%u}", heapAlarmOn ? "true" : "false", last.maxFreeBlock);
+  events::post("alarm", data);
+  // Published without waiting for the interval
+  publishMetrics();
+  lastPublishTime = millis();
+}
+
+// Prometheus text format, sent line by line to avoid a large buffer
+void sendMetric(ESP8266WebServer *server, const char* name, const char* type, const char* help, uint32_t value)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %u\n", name, help, name, type, name, value);
+  server->sendContent(line);
+}
+
+void handleMetricsRequest()
+{
+  takeSample();
+  ESP8266WebServer *server = wifi::getWebServer();
+  server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server->send(200, "text/plain; version=0.0.4", "");
+  sendMetric(server, "shelly_heap_free_bytes", "gauge", "Free heap", last.freeHeap);
+  sendMetric(server, "shelly_heap_free_min_bytes", "gauge", "Lowest free heap since boot", minFreeHeap);
+  sendMetric(server, "shelly_heap_max_block_bytes", "gauge", "Largest free block", last.maxFreeBlock);
+  sendMetric(server, "shelly_heap_max_block_min_bytes", "gauge", "Lowest largest free block since boot", minMaxFreeBlock);
+  sendMetric(server, "shelly_heap_fragmentation_percent", "gauge", "Heap fragmentation", last.fragmentation);
+  sendMetric(server, "shelly_heap_fragmentation_max_percent", "gauge", "Highest heap fragmentation since boot", maxFragmentation);
+  sendMetric(server, "shelly_stack_free_bytes", "gauge", "Stack of the loop never used since boot", last.freeStack);
+  sendMetric(server, "shelly_heap_alarm", "gauge", "Largest free block below the alarm threshold", heapAlarmOn ? 1 : 0);
+  #ifdef ALLOCATION_COUNTER
+  sendMetric(server, "shelly_heap_allocations_total", "counter", "Calls to malloc, calloc and realloc since boot", allocations);
+  sendMetric(server, "shelly_heap_allocations_after_boot_total", "counter", "Allocations after the setup of the modules, 0 in steady state",
+             allocations - bootAllocations);
+  #endif
+  sendMetric(server, "shelly_telnet_dropped_bytes_total", "counter", "Log bytes overwritten before being sent to a telnet client",
+             logging::getTelnetDroppedBytes());
+  sendMetric(server, "shelly_uptime_seconds", "counter", "Time since boot", millis() / 1000);
+  server->sendContent("");
+}
+
+void bindServerCallback()
+{
+  wifi::getWebServer()->on("/metrics", handleMetricsRequest);
+}
+
+void updateParams()
+{
+  logging::getLogStream().println("metrics: updateParams");
+  uint16_t value = 4096;
+  helpers::convertToInteger(wifi::getParamValueFromID("heapAlarm"), value, 5);
+  heapAlarm = value;
+  value = 60;
+  helpers::convertToInteger(wifi::getParamValueFromID("metricsInterval"), value, 5);
+  metricsInterval = value;
+  if (heapAlarm == 0)
+    heapAlarmOn = false;
+}
+
+void setup()
+{
+  takeSample();
+  scheduler::addTask("metrics", handle, scheduler::PRIORITY_LOW, SAMPLE_PERIOD, 1000);
+}
+
+void handle()
+{
+  takeSample();
+  #ifdef ALLOCATION_COUNTER
+  checkAllocations();
+  #endif
+  checkAlarm();
+  if (metricsInterval > 0 && millis() - lastPublishTime >= (unsigned long)metricsInterval * 1000)
+  {
+    publishMetrics();
+    lastPublishTime = millis();
+  }
+}
+
+}
@@ -0,0 +1,23 @@
+#ifndef METRICS
+#define METRICS
+
+#include <Arduino.h>
+
+namespace metrics
+{
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
+  // Lowest free heap and largest free block since boot
+  uint32_t getMinFreeHeap();
+  uint32_t getMinMaxFreeBlock();
+  bool getHeapAlarm();
+
+  void printHeap();
+  void bindServerCallback();
+  void updateParams();
+  void setup();
+  void handle();
+}
+
+#endif
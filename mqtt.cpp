@@ -1,11 +1,16 @@
 #include <Arduino.h>
+#include <new>
 
 #include "config.h"
 #include "wifi.h"
 #include "logging.h"
 #include "switches.h"
+#include "rules.h"
+#include "scheduler.h"
 #include "light.h"
 #include "mqtt.h"
+#include "discovery.h"
+#include "watchdog.h"
 
 /*
 #include "Adafruit_MQTT.h"
@@ -16,9 +21,90 @@
 
 namespace mqtt
 {
+#define MAX_BROKERS             4       // The primary broker and the fallback ones
+#define MQTT_TCP_TIMEOUT        250     // ms, the TCP connect of the ESP8266 core is blocking
+#define MQTT_CONNACK_TIMEOUT    3000    // ms to wait for the CONNACK from the broker
+#define MQTT_KEEPALIVE_S        15      // s, PubSubClient sends a PINGREQ after this time without traffic
+#define MQTT_TEMP_PERIOD        5000    // ms between two publications of the temperature
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Socket given to PubSubClient. PubSubClient::connect() sends the CONNECT and then    //
+// waits for the CONNACK. To avoid this wait, connect() is called twice:               //
+//  - SendConnect: the CONNECT is sent, available() returns 0 so that PubSubClient     //
+//    gives up immediately (socket timeout of 0) and its stop() is ignored             //
+//  - ReplayConnect: once the CONNACK has arrived, the CONNECT is not sent again and   //
+//    PubSubClient reads the CONNACK                                                   //
+/////////////////////////////////////////////////////////////////////////////////////////
+class MqttSocket : public Client
+{
+  public:
+    enum Mode { Normal, SendConnect, ReplayConnect };
+
+    MqttSocket(WiFiClient &c) : client(c), mode(Normal) {}
+    void setMode(Mode m) { mode = m; }
+
+    virtual int connect(IPAddress ip, uint16_t port) { return client.connect(ip, port); }
+    virtual int connect(const char *host, uint16_t port) { return client.connect(host, port); }
+    virtual size_t write(uint8_t data) { return write(&data, 1); }
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+      // The CONNECT packet has already been sent
+      if (mode == ReplayConnect)
+        return size;
+      lastWriteTime = millis();
+      return client.write(buf, size);
+    }
+    virtual int available() { return (mode == SendConnect) ? 0 : client.available(); }
+    virtual int read() { lastReadTime = millis(); return client.read(); }
+    virtual int read(uint8_t *buf, size_t size) { lastReadTime = millis(); return client.read(buf, size); }
+    virtual int peek() { return client.peek(); }
+    virtual void flush() { client.flush(); }
+    virtual void stop()
+    {
+      // Keep the connection open while waiting for the CONNACK
+      if (mode != SendConnect)
+        client.stop();
+    }
+    virtual uint8_t connected() { return client.connected(); }
+    virtual operator bool() { return (bool)client; }
+
+    // For the keepalive of PubSubClient
+    unsigned long lastWriteTime = 0;
+    unsigned long lastReadTime = 0;
+
+  private:
+    WiFiClient &client;
+    Mode mode;
+};
+
+// Size of the buffer of PubSubClient, for the largest message sent or received
+#define MQTT_BUFFER_SIZE 1536
+
 WiFiClient wifiClient;
+MqttSocket mqttSocket(wifiClient);
 //Adafruit_MQTT *mqttClient = NULL;
 PubSubClient *mqttClient = NULL;
+#ifdef STATIC_ALLOCATION
+// Built at the first use, then kept for the whole uptime
+alignas(PubSubClient) uint8_t mqttClientStorage[sizeof(PubSubClient)];
+PubSubClient *staticMqttClient = NULL;
+#endif
+
+// The states of the connection to the broker
+enum { MQTT_STATE_DISCONNECTED, MQTT_STATE_TCP_CONNECTING, MQTT_STATE_WAITING_CONNACK, MQTT_STATE_SUBSCRIBING, MQTT_STATE_CONNECTED };
+uint8_t connectionState = MQTT_STATE_DISCONNECTED;
+unsigned long stepStartTime = 0;      // For the timeout of the current step
+
+// For the persistent session
+bool persistentSession = false;       // Clean session off, the broker keeps the subscriptions and the queued messages
+bool sessionPresent = false;          // Session kept by the broker, given by the CONNACK
+bool sessionSubscribed = false;       // The topics have been subscribed within the persistent session
+bool topicsChanged = false;           // The old session should be cleaned since it may have other subscriptions
+uint32_t subscribedTopicsHash = 0;    // Hash of the topics last subscribed, 0 when not subscribed since the boot
+uint16_t subscribeMsgId = 0x8000;     // Not in the range used by PubSubClient
+
+// Time budget for processing the received packets within one loop, 0 for one packet per loop
+uint16_t loopBudget = 2000;           // In us
 
 char mqttClientId[18] = {0x00};  //98_F4_AB_B9_8A_73
 #define NB_MAX_SUBSCRIBE 7
@@ -27,48 +113,197 @@ char mqttClientId[18] = {0x00};  //98_F4_AB_B9_8A_73
 // For the MQTT broker
 unsigned long lastReconnectAttemptTime = 0;
 unsigned long lastTempPublishTime = 0;      // For pubishing the temperature at regular time
-const char* mqttServerIP;
+const char* mqttServerIP;                   // The broker currently used
 uint16 mqttPort = 0;
+
+// The brokers are tried by decreasing health score, the primary broker first in case of equality
+struct Broker
+{
+  const char* host;
+  uint16_t port;
+  uint8_t score;      // 100 for a healthy broker, halved at each failed connection
+};
+Broker brokers[MAX_BROKERS];
+uint8_t nbBrokers = 0;
+uint8_t currentBroker = 0;
+char fallbackServers[101];                  // Copy of the parameter, split in place into host and port strings
+
+// For the exponential backoff of the reconnections
+uint16_t backoffMin = 1000;                 // In ms
+uint16_t backoffMax = 60;                   // In seconds
+uint8_t failedAttempts = 0;
+unsigned long reconnectDelay = 0;
 char receivedMqttMsg[100];
+char receivedMqttTopic[101];
+
+// The parameters for the connection to the broker, a change requires a reconnection
+const char* const paramKeys[] = {"mqttServer", "mqttPort", "mqttFallbackServers", "mqttPersistentSession", "pubMqttStatus", NULL};
+// The parameters that can be changed while connected
+const char* const tuningKeys[] = {"mqttBackoffMin", "mqttBackoffMax", "mqttLoopBudget", NULL};
+const char* const subscriptionKeys[] = {"subMqtt*", NULL};
+
+// For the configuration received by MQTT
+bool configPatchReceived = false;
+uint8_t nbConfigChanges = 0;
 
 
 void callback(char* topic, byte* msg, unsigned int length)
 {
-  if (length>sizeof(receivedMqttMsg)+1)
+  // find to which functionnality this topic is associated with
+  const char* paramID = wifi::getIDFromParamValue(topic);
+
+  // The configuration patch is parsed directly from the MQTT buffer
+  if (paramID != NULL && strcmp(paramID, "subMqttConfig") == 0)
+  {
+    logging::getLogStream().printf("mqtt: receiving a configuration patch of %u bytes\n", length);
+    nbConfigChanges += wifi::applyConfigPatch((const char*)msg, length);
+    // Saved after the loop of PubSubClient since it may reconnect to the broker
+    configPatchReceived = true;
+    return;
+  }
+
+  // Start the configuration portal when it runs on demand
+  if (paramID != NULL && strcmp(paramID, "subMqttPortal") == 0)
+  {
+    logging::getLogStream().printf("mqtt: configuration portal requested\n");
+    wifi::requestPortal();
+    return;
+  }
+
+  if (length>sizeof(receivedMqttMsg)-1)
   {
     memcpy(receivedMqttMsg,msg,sizeof(receivedMqttMsg)-1);
     receivedMqttMsg[sizeof(receivedMqttMsg)-1]=0x00;
     logging::getLogStream().printf("mqtt: error msg too long \"%s\" and payload \"%s\"\n", topic, receivedMqttMsg);
     return;
   }
+  // The topic is in the buffer of PubSubClient, which is overwritten when a rule publishes
+  if (strlen(topic)>sizeof(receivedMqttTopic)-1)
+  {
+    logging::getLogStream().printf("mqtt: error topic too long \"%.*s\"\n", sizeof(receivedMqttTopic)-1, topic);
+    return;
+  }
+  strcpy(receivedMqttTopic,topic);
   memcpy(receivedMqttMsg,msg,length);
   receivedMqttMsg[length]=0x00;
   // handle message arrived
-  logging::getLogStream().printf("mqtt: receiving a message with topic \"%s\" and payload \"%s\"\n", topic, receivedMqttMsg);
+  logging::getLogStream().printf("mqtt: receiving a message with topic \"%s\" and payload \"%s\"\n", receivedMqttTopic, receivedMqttMsg);
 
-  // find to which functionnality this topic is associated with
-  const char* paramID = wifi::getIDFromParamValue(topic);
+  rules::onMqttMessage(receivedMqttTopic, (char*)receivedMqttMsg);
   if (paramID != NULL)
     light::mqttCallback(paramID, (char*)receivedMqttMsg);
 }
 
+void addBroker(const char* host, uint16_t port)
+{
+  if (nbBrokers >= MAX_BROKERS || host == NULL || strlen(host) == 0)
+    return;
+  brokers[nbBrokers].host = host;
+  brokers[nbBrokers].port = port;
+  brokers[nbBrokers].score = 100;
+  nbBrokers++;
+}
+
+// Parse the fallback brokers given as "host[:port],host[:port]"
+void addFallbackBrokers(const char* str)
+{
+  if (str == NULL)
+    return;
+  strncpy(fallbackServers, str, sizeof(fallbackServers) - 1);
+  fallbackServers[sizeof(fallbackServers) - 1] = 0x00;
+  char* host = strtok(fallbackServers, ", ");
+  while (host != NULL)
+  {
+    uint16_t port = mqttPort;
+    char* sep = strchr(host, ':');
+    if (sep != NULL)
+    {
+      *sep = 0x00;
+      helpers::convertToInteger(sep + 1, port, 5);
+    }
+    logging::getLogStream().printf("mqtt: fallback MQTT broker %s:%d\n", host, port);
+    addBroker(host, port);
+    host = strtok(NULL, ", ");
+  }
+}
+
+// Select the broker with the best health score
+void selectBroker()
+{
+  uint8_t best = 0;
+  for (uint8_t i = 1; i < nbBrokers; i++)
+    if (brokers[i].score > brokers[best].score)
+      best = i;
+  // The brokers not selected slowly recover
+  for (uint8_t i = 0; i < nbBrokers; i++)
+    if (i != best && brokers[i].score <= 95)
+      brokers[i].score += 5;
+  currentBroker = best;
+  mqttServerIP = brokers[best].host;
+  mqttPort = brokers[best].port;
+  mqttClient->setServer(mqttServerIP, mqttPort);
+}
+
+// Exponential backoff with full jitter: the delay is random between 0 and min(max, min*2^failedAttempts)
+// so that the devices do not reconnect all at the same time when the broker restarts
+void scheduleReconnect()
+{
+  unsigned long maxDelay = backoffMin;
+  for (uint8_t i = 0; i < failedAttempts && maxDelay < backoffMax * 1000UL; i++)
+    maxDelay *= 2;
+  if (maxDelay > backoffMax * 1000UL)
+    maxDelay = backoffMax * 1000UL;
+  reconnectDelay = random(maxDelay + 1);
+  lastReconnectAttemptTime = millis();
+  logging::getLogStream().printf("mqtt: next connection attempt in %lu ms\n", reconnectDelay);
+}
+
+// The parameters that do not need a reconnection
+void updateTuningParams()
+{
+  logging::getLogStream().printf("mqtt: updateTuningParams\n");
+  // The delays for the reconnections
+  uint16_t val;
+  backoffMin = 1000;
+  if (helpers::convertToInteger(wifi::getParamValueFromID("mqttBackoffMin"), val, 5) && val > 0)
+    backoffMin = val;
+  backoffMax = 60;
+  if (helpers::convertToInteger(wifi::getParamValueFromID("mqttBackoffMax"), val, 5) && val > 0)
+    backoffMax = val;
+  loopBudget = 2000;
+  const char* budget = wifi::getParamValueFromID("mqttLoopBudget");
+  if (budget != NULL && helpers::convertToInteger(budget, val, 5))
+    loopBudget = val;
+}
+
+void checkTopicsChanged();
+
 void updateParams()
 {
   logging::getLogStream().printf("mqtt: updateParams\n");
 
+  // A config change may have changed the topics to subscribe
+  checkTopicsChanged();
+  sessionSubscribed = false;
+
   // Disconnect the mqttClient if it is connected
   if (mqttClient != NULL)
   {
     logging::getLogStream().printf("mqtt: disconnect from %s:%d\n", mqttServerIP, mqttPort);
     // delete the mqttClient
     mqttClient->disconnect();
+    #ifndef STATIC_ALLOCATION
     delete mqttClient;
+    #endif
     mqttClient = NULL;
   }
+  connectionState = MQTT_STATE_DISCONNECTED;
   // Get the broker and port from wifiManager
   const char* buff = wifi::getParamValueFromID("mqttPort");
   if (buff != NULL)
     mqttPort = atoi(buff);
+  const char* persistent = wifi::getParamValueFromID("mqttPersistentSession");
+  persistentSession = (persistent != NULL && persistent[0] == '1');
   // Set the new MQTT sever configuration
   mqttServerIP = wifi::getParamValueFromID("mqttServer");
   if (mqttServerIP != NULL && strlen(mqttServerIP) > 0)
@@ -79,24 +314,84 @@ void updateParams()
     const char* tmp=helpers::hexToStr(mac, 6);
     memcpy(mqttClientId,tmp,sizeof(mqttClientId));
     logging::getLogStream().printf("mqtt: MQTT cliend Id %s\n", mqttClientId);
-    mqttClient = new PubSubClient(wifiClient);
-    mqttClient->setServer(mqttServerIP, mqttPort);
+    #ifdef STATIC_ALLOCATION
+    // The buffer keeps its size, so setBufferSize() does not allocate again
+    if (staticMqttClient == NULL)
+      staticMqttClient = new (mqttClientStorage) PubSubClient(mqttSocket);
+    mqttClient = staticMqttClient;
+    #else
+    mqttClient = new PubSubClient(mqttSocket);
+    #endif
     mqttClient->setCallback(callback);
+    // Large enough for the configuration patches
+    mqttClient->setBufferSize(MQTT_BUFFER_SIZE);
+    mqttClient->setKeepAlive(MQTT_KEEPALIVE_S);
+    // The primary broker first, then the fallback ones
+    nbBrokers = 0;
+    addBroker(mqttServerIP, mqttPort);
+    addFallbackBrokers(wifi::getParamValueFromID("mqttFallbackServers"));
+    selectBroker();
+    failedAttempts = 0;
+    scheduleReconnect();
     //mqttClient = new Adafruit_MQTT_Client(&wifiClient, mqttServerIP, mqttPort, mqttClientId, "", "");
   }
   else
     logging::getLogStream().printf("mqtt: MQTT broker not defined\n");
 }
 
+// Time in ms before the task has work to do, for the idle mode of the scheduler
+// When connected, the PINGREQ of the keepalive is a deadline so that a long sleepMaxDelay does not drop the connection
+uint32_t getTimeToNextDeadline()
+{
+  if (mqttClient == NULL)
+    return 0xFFFFFFFF;
+  unsigned long now = millis();
+  if (connectionState == MQTT_STATE_DISCONNECTED)
+  {
+    unsigned long elapsed = now - lastReconnectAttemptTime;
+    return (elapsed >= reconnectDelay) ? 0 : reconnectDelay - elapsed;
+  }
+  if (connectionState != MQTT_STATE_CONNECTED || configPatchReceived)
+    return 0;
+  // PubSubClient sends the PINGREQ once the time without sending or receiving is above the keepalive
+  unsigned long elapsed = max(now - mqttSocket.lastWriteTime, now - mqttSocket.lastReadTime);
+  uint32_t deadline = (elapsed > MQTT_KEEPALIVE_S * 1000UL) ? 0 : MQTT_KEEPALIVE_S * 1000UL + 1 - elapsed;
+  elapsed = now - lastTempPublishTime;
+  deadline = min(deadline, (uint32_t)((elapsed > MQTT_TEMP_PERIOD) ? 0 : MQTT_TEMP_PERIOD + 1 - elapsed));
+  return deadline;
+}
+
 void setup()
 {
+  scheduler::addTask("mqtt", handle, scheduler::PRIORITY_NORMAL, 0, 5000, getTimeToNextDeadline);
+}
+
+const char* getClientId()
+{
+  return mqttClientId;
+}
+
+// The broker currently used
+const char* getBrokerHost()
+{
+  return mqttServerIP;
+}
+
+uint16_t getBrokerPort()
+{
+  return mqttPort;
+}
+
+bool isConnected()
+{
+  return connectionState == MQTT_STATE_CONNECTED;
 }
 
-bool publishMQTT(const char *topic, const char *payload)
+bool publishMQTT(const char *topic, const char *payload, bool retained)
 {
   if (mqttClient == NULL)
     return false;
-  if (mqttClient->publish(topic, payload))
+  if (mqttClient->publish(topic, payload, retained))
   {
     logging::getLogStream().printf("mqtt: publishing with topic \"%s\" and payload \"%s\"\n", topic, payload);
     return true;
@@ -110,12 +405,60 @@ bool publishMQTT(const char *topic, const char *payload)
 }
 
 
+// Print counting the bytes, to know the length of a payload before streaming it
+class CountingPrint : public Print
+{
+  public:
+    size_t count = 0;
+    virtual size_t write(uint8_t data) { count++; return 1; }
+    virtual size_t write(const uint8_t *buffer, size_t size) { count += size; return size; }
+};
+
+// Publish a payload generated by render() directly into the MQTT packet, without building it in memory
+// render() is called twice: first for the length of the payload, then for sending it
+bool publishMQTTStream(const char *topic, void (*render)(Print &out), bool retained)
+{
+  if (mqttClient == NULL)
+    return false;
+  CountingPrint counter;
+  render(counter);
+  if (mqttClient->beginPublish(topic, counter.count, retained))
+  {
+    render(*mqttClient);
+    if (mqttClient->endPublish())
+    {
+      logging::getLogStream().printf("mqtt: publishing with topic \"%s\" and a payload of %u bytes\n", topic, (unsigned int)counter.count);
+      return true;
+    }
+  }
+  logging::getLogStream().printf("mqtt: failed to publish with topic \"%s\" and a payload of %u bytes\n", topic, (unsigned int)counter.count);
+  return false;
+}
+
+// Publish the snapshot of the device state, retained so that a new subscriber gets it immediately
+// This is also the birth message, the last will on the same topic is {"status":"offline"}
+bool publishStatus()
+{
+  const char* topic = wifi::getParamValueFromID("pubMqttStatus");
+  // If no topic, we do not publish
+  if (topic == NULL || connectionState != MQTT_STATE_CONNECTED)
+    return false;
+  char payload[160];
+  const char* hn = wifi::getParamValueFromID("hostname");
+  snprintf(payload, sizeof(payload),
+           "{\"status\":\"online\",\"light\":\"%s\",\"temperature\":%.1f,\"overheat\":%s,\"hostname\":\"%s\",\"ip\":\"%s\"}",
+           light::lightIsOn() ? "ON" : "OFF", switches::getTemperature(),
+           switches::getOverheatingAlarm() ? "true" : "false",
+           hn != NULL ? hn : mqttClientId, helpers::ipToStr((uint32_t)WiFi.localIP()));
+  return publishMQTT(topic, payload, true);
+}
+
 void publishMQTTTempAtRegularInterval()
 {
   if (mqttClient == NULL)
     return;
   unsigned long now = millis();
-  if (now - lastTempPublishTime > 5000)
+  if (now - lastTempPublishTime > MQTT_TEMP_PERIOD)
   {
     lastTempPublishTime = now;
     const char* topic = wifi::getParamValueFromID("pubMqttTemperature");
@@ -124,44 +467,273 @@ void publishMQTTTempAtRegularInterval()
     {
       char payload[8];
       int temperature = switches::getTemperature();
-      sprintf(payload, "%d", temperature);
-      publishMQTT(topic, payload);
+      snprintf(payload, sizeof(payload), "%d", temperature);
+      publishMQTT(topic, payload, true);
     }
   }
 }
 
+// Return the topic to subscribe for this parameter, NULL if none
+const char* getSubscribeTopic(WiFiManagerParameter* param)
+{
+  if (param->getID() == NULL)
+    return NULL;
+  if (strncmp(param->getID(), "subMqtt", 7) != 0)
+    return NULL;
+  if (param->getValue() == NULL)
+    return NULL;
+  if (strlen(param->getValue()) == 0)
+    return NULL;
+  return param->getValue();
+}
+
+// The topics to subscribe are those of the parameters followed by those of the rules
+uint16_t getNbTopicsToSubscribe()
+{
+  return wifi::getWifiManager().getParametersCount() + rules::getNbMqttTopics();
+}
+
+const char* getTopicToSubscribe(uint16_t index)
+{
+  int nbParams = wifi::getWifiManager().getParametersCount();
+  if (index < nbParams)
+    return getSubscribeTopic(wifi::getWifiManager().getParameters()[index]);
+  return rules::getMqttTopic(index - nbParams);
+}
+
+uint32_t computeTopicsHash()
+{
+  uint32_t hash = helpers::fnv1a(NULL);
+  for (uint16_t i = 0; i < getNbTopicsToSubscribe(); i++)
+  {
+    const char* topic = getTopicToSubscribe(i);
+    if (topic != NULL)
+      hash = helpers::fnv1a(topic, hash);
+  }
+  return hash;
+}
+
+// The persistent session keeps the topics subscribed before, it is cleaned at the next connection
+// only if they differ from the current ones. At the boot, the session is kept whatever its topics.
+void checkTopicsChanged()
+{
+  if (subscribedTopicsHash != 0 && computeTopicsHash() != subscribedTopicsHash)
+    topicsChanged = true;
+}
+
+// Subscribe to all the topics with a single SUBSCRIBE packet
+// Return the number of topics subscribed
+uint8_t subscribeToAllTopics()
+{
+  subscribedTopicsHash = computeTopicsHash();
+  // QoS 1 for the persistent session, otherwise the broker does not queue the messages
+  uint8_t qos = persistentSession ? 1 : 0;
+
+  // Compute the remaining length of the packet
+  uint32_t length = 2;                // Packet identifier
+  uint8_t nbTopics = 0;
+  for (uint16_t i = 0; i < getNbTopicsToSubscribe(); i++)
+  {
+    const char* topic = getTopicToSubscribe(i);
+    if (topic == NULL)
+      continue;
+    length += 2 + strlen(topic) + 1;  // Topic length, topic and QoS
+    nbTopics++;
+  }
+  if (nbTopics == 0)
+    return 0;
+
+  // Fixed header, remaining length and packet identifier
+  uint8_t header[8];
+  uint8_t headerLength = 0;
+  header[headerLength++] = 0x82;      // SUBSCRIBE
+  do
+  {
+    uint8_t digit = length % 128;
+    length = length / 128;
+    if (length > 0)
+      digit |= 0x80;
+    header[headerLength++] = digit;
+  } while (length > 0);
+  subscribeMsgId++;
+  if (subscribeMsgId == 0)
+    subscribeMsgId = 0x8000;
+  header[headerLength++] = subscribeMsgId >> 8;
+  header[headerLength++] = subscribeMsgId & 0xFF;
+  mqttSocket.write(header, headerLength);
+
+  // The topic filters
+  for (uint16_t i = 0; i < getNbTopicsToSubscribe(); i++)
+  {
+    const char* topic = getTopicToSubscribe(i);
+    if (topic == NULL)
+      continue;
+    uint16_t topicLength = strlen(topic);
+    uint8_t buf[2] = {(uint8_t)(topicLength >> 8), (uint8_t)(topicLength & 0xFF)};
+    mqttSocket.write(buf, 2);
+    mqttSocket.write((const uint8_t*)topic, topicLength);
+    mqttSocket.write(&qos, 1);
+    logging::getLogStream().printf("mqtt: subscribing to %s\n", topic);
+  }
+  return nbTopics;
+}
+
+// Resubscribe without reconnecting when only the topics have changed
+void updateSubscriptions()
+{
+  logging::getLogStream().printf("mqtt: updateSubscriptions\n");
+  checkTopicsChanged();
+  if (connectionState == MQTT_STATE_CONNECTED)
+  {
+    subscribeToAllTopics();
+    sessionSubscribed = persistentSession;
+  }
+  else
+    sessionSubscribed = false;
+}
+
+// Send the CONNECT packet (or read the CONNACK when replaying)
+bool sendConnect()
+{
+  bool cleanSession = !persistentSession || topicsChanged;
+  // Last will to let the subscribers know that the device is gone
+  const char* willTopic = wifi::getParamValueFromID("pubMqttStatus");
+  return mqttClient->connect(mqttClientId, NULL, NULL, willTopic, 1, true, "{\"status\":\"offline\"}", cleanSession);
+}
+
+void connectionFailed(const char* reason)
+{
+  logging::getLogStream().printf("mqtt: failed to connect to %s:%d (%s)\n", mqttServerIP, mqttPort, reason);
+  mqttSocket.setMode(MqttSocket::Normal);
+  mqttSocket.stop();
+  connectionState = MQTT_STATE_DISCONNECTED;
+  brokers[currentBroker].score /= 2;
+  if (failedAttempts < 255)
+    failedAttempts++;
+  scheduleReconnect();
+}
+
+// Non-blocking connection to the broker, each call executes at most one step
 void connectToMQTTServer()
 {
-  // Attempt to reconnect
-  bool ret = mqttClient->connect(mqttClientId);
-  if (ret == true)
+  unsigned long now = millis();
+  switch (connectionState)
   {
-    // connect will return 0 for connected
-    lastReconnectAttemptTime = 0;
-    logging::getLogStream().printf("mqtt: connected to %s:%d\n", mqttServerIP, mqttPort);
+    case MQTT_STATE_DISCONNECTED:
+      if (now - lastReconnectAttemptTime >= reconnectDelay)
+      {
+        selectBroker();
+        connectionState = MQTT_STATE_TCP_CONNECTING;
+      }
+      break;
 
-    // Subscribe to all the topics
-    int topicIdx = 0;
-    WiFiManagerParameter** customParams = wifi::getWifiManager().getParameters();
-    for (int i = 0; i < wifi::getWifiManager().getParametersCount(); i++)
+    case MQTT_STATE_TCP_CONNECTING:
     {
-      if (customParams[i]->getID() == NULL)
-        continue;
-      if (strncmp(customParams[i]->getID(), "subMqtt", 7) != 0)
-        continue;
-      if (customParams[i]->getValue() == NULL)
-        continue;
-      if (strlen(customParams[i]->getValue()) == 0)
-        continue;
-
-      //mqttSubscribe[topicIdx] = new Adafruit_MQTT_Subscribe(mqttClient, customParams[i]->getValue(), 2);        // QoS=2
-      mqttClient->subscribe(customParams[i]->getValue());
-      topicIdx++;
-      logging::getLogStream().printf("mqtt: subscribing to %s\n", customParams[i]->getValue());
+      // The connect() of WiFiClient waits until the timeout, keep it short
+      wifiClient.setTimeout(MQTT_TCP_TIMEOUT);
+      IPAddress ip;
+      if (!ip.fromString(mqttServerIP) && !WiFi.hostByName(mqttServerIP, ip, MQTT_TCP_TIMEOUT))
+      {
+        connectionFailed("DNS");
+        break;
+      }
+      if (!mqttSocket.connect(ip, mqttPort))
+      {
+        connectionFailed("TCP");
+        break;
+      }
+      // Send the CONNECT packet without waiting for the CONNACK
+      mqttSocket.setMode(MqttSocket::SendConnect);
+      mqttClient->setSocketTimeout(0);
+      sendConnect();
+      mqttSocket.setMode(MqttSocket::Normal);
+      stepStartTime = now;
+      connectionState = MQTT_STATE_WAITING_CONNACK;
+      break;
     }
+
+    case MQTT_STATE_WAITING_CONNACK:
+      if (!mqttSocket.connected())
+        connectionFailed("connection closed");
+      else if (mqttSocket.available() >= 4)
+      {
+        // The CONNACK is there, check if the broker kept our session
+        char connack[4];
+        wifiClient.peekBytes(connack, sizeof(connack));
+        sessionPresent = (connack[2] & 0x01) != 0;
+        // PubSubClient can read the CONNACK
+        mqttSocket.setMode(MqttSocket::ReplayConnect);
+        mqttClient->setSocketTimeout(1);
+        bool ret = sendConnect();
+        mqttSocket.setMode(MqttSocket::Normal);
+        if (ret)
+        {
+          logging::getLogStream().printf("mqtt: connected to %s:%d\n", mqttServerIP, mqttPort);
+          brokers[currentBroker].score = 100;
+          failedAttempts = 0;
+          topicsChanged = false;
+          connectionState = MQTT_STATE_SUBSCRIBING;
+        }
+        else
+          connectionFailed("CONNACK refused");
+      }
+      else if (now - stepStartTime > MQTT_CONNACK_TIMEOUT)
+        connectionFailed("CONNACK timeout");
+      break;
+
+    case MQTT_STATE_SUBSCRIBING:
+      // Subscribe to all the topics, unless the broker already has them in our persistent session
+      if (persistentSession && sessionPresent && sessionSubscribed)
+        logging::getLogStream().printf("mqtt: session resumed, no need to subscribe\n");
+      else
+      {
+        subscribeToAllTopics();
+        sessionSubscribed = persistentSession;
+      }
+      connectionState = MQTT_STATE_CONNECTED;
+      watchdog::breadcrumb(watchdog::CRUMB_MQTT_CONNECTED);
+      // Birth message with the state of the device
+      publishStatus();
+      // Home Assistant discovery, only if the configuration has changed
+      discovery::publishConfig();
+      // Report of the last abnormal reset, only once
+      watchdog::publishReport();
+      // Publish the current state since it may have changed while disconnected
+      light::republishState();
+      switches::republishState();
+      lastTempPublishTime = millis() - 5000;
+      break;
   }
-  else
-    logging::getLogStream().printf("mqtt: failed to connect to %s:%d\n", mqttServerIP, mqttPort);
+}
+
+// Acknowledge and save the configuration received by MQTT
+void saveConfigPatch()
+{
+  configPatchReceived = false;
+  uint8_t nbChanges = nbConfigChanges;
+  nbConfigChanges = 0;
+  // The acknowledgement is sent first since saving may reconnect to the broker
+  const char* topic = wifi::getParamValueFromID("pubMqttConfigAck");
+  if (topic != NULL)
+  {
+    char payload[40];
+    snprintf(payload, sizeof(payload), "{\"hash\":\"%08x\",\"changed\":%d}", (unsigned int)wifi::getConfigHash(), nbChanges);
+    publishMQTT(topic, payload);
+  }
+  if (nbChanges > 0)
+    wifi::saveParams();
+}
+
+// Process all the received packets within the time budget, so that a burst of commands
+// is handled at once and not one packet per loop
+void processIncomingPackets()
+{
+  unsigned long start = micros();
+  do
+  {
+    mqttClient->loop();
+  }
+  while (loopBudget > 0 && mqttSocket.available() > 0 && micros() - start < loopBudget);
 }
 
 void handle()
@@ -169,20 +741,39 @@ void handle()
   // If the MQTT server has been defined
   if (mqttClient != NULL)
   {
+    // Check if the connection has been lost
+    if (connectionState >= MQTT_STATE_SUBSCRIBING && !mqttClient->connected())
+    {
+      logging::getLogStream().printf("mqtt: connection lost to %s:%d\n", mqttServerIP, mqttPort);
+      watchdog::breadcrumb(watchdog::CRUMB_MQTT_LOST, mqttClient->state());
+      connectionState = MQTT_STATE_DISCONNECTED;
+      failedAttempts = 0;
+      scheduleReconnect();
+    }
+
     // If not connected
-    if (!mqttClient->connected())
+    if (connectionState != MQTT_STATE_CONNECTED)
     {
-      unsigned long now = millis();
-      if (now - lastReconnectAttemptTime > 5000)
-      {
-        lastReconnectAttemptTime = now;
-        connectToMQTTServer();
-      }
+      connectToMQTTServer();
+      if (connectionState == MQTT_STATE_SUBSCRIBING)
+        mqttClient->loop();
+      // No sleep during the handshake with the broker
+      if (connectionState != MQTT_STATE_DISCONNECTED)
+        scheduler::stayAwake();
     }
     else
     {
       // mqttClient connected, check for the topics that have been subscribed
-      mqttClient->loop();
+      // The commands are processed before publishing the telemetry
+      processIncomingPackets();
+      // The packets left by the time budget are processed at the next pass
+      if (mqttSocket.available() > 0)
+        scheduler::stayAwake();
+      if (configPatchReceived)
+      {
+        saveConfigPatch();
+        return;
+      }
 
       // Publish the temperature at regular interval
       publishMQTTTempAtRegularInterval();
@@ -7,14 +7,27 @@
 
 namespace mqtt
 { 
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+  extern const char* const tuningKeys[];
+  extern const char* const subscriptionKeys[];
+
   void callback(char* topic, byte* payload, unsigned int length);
   void updateParams();
+  void updateTuningParams();
+  void updateSubscriptions();
   void setup();
+  const char* getClientId();
+  const char* getBrokerHost();
+  uint16_t getBrokerPort();
+  bool isConnected();
   boolean reconnect();
   void handle();
 
   // Methods for publishing to MQTT
-  bool publishMQTT(const char *topic, const char *payload);
+  bool publishMQTT(const char *topic, const char *payload, bool retained=false);
+  bool publishMQTTStream(const char *topic, void (*render)(Print &out), bool retained=false);
+  bool publishStatus();
 }
 
 #endif
@@ -0,0 +1,755 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "light.h"
+#include "mqtt.h"
+#include "switches.h"
+#include "rules.h"
+#include "scheduler.h"
+
+
+namespace rules
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Local automations given in the parameter "rules", separated by ';'    //
+//   <trigger> [if <condition> [and <condition>...]] then <action>[, ...] //
+// Triggers:   switch <id> <click|double|long|on|off|onoffon|offonoff>    //
+//             temp above|below <°C>, overheat, every <s>                 //
+//             mqtt <topic> [<payload>]                                   //
+// Conditions: light on|off, temp above|below <°C>                        //
+// Actions:    on, off, toggle, blink [<s>], publish <topic> <payload>,   //
+//             portal (starts the configuration portal)                   //
+// Example: "switch 1 double then publish switchOffAll off;               //
+//           overheat then blink 30; every 3600 if light on then off"     //
+// The rules are compiled to bytecode when saved and stored in           //
+// /rules.bin. They are evaluated when their event occurs, after the     //
+// default behaviour of the switches                                     //
+///////////////////////////////////////////////////////////////////////////
+
+#define RULES_FILE          "/rules.bin"
+#define RULES_VERSION       1
+#define RULES_HEADER_SIZE   10
+#define MAX_PROGRAM_SIZE    512
+#define MAX_RULES           16
+#define MAX_TOKEN_LENGTH    64
+
+// Bytecode of a rule: its length, the trigger, the conditions and the actions
+// The strings are stored as their length, the characters and a final 0x00
+enum
+{
+  T_SWITCH = 0x01,      // switch id, state
+  T_TEMP_ABOVE,         // int16 tenths of °C
+  T_TEMP_BELOW,         // int16 tenths of °C
+  T_OVERHEAT,
+  T_MQTT,               // topic string, payload string (empty for any payload)
+  T_EVERY,              // uint16 period in s
+  C_LIGHT_ON = 0x10,
+  C_LIGHT_OFF,
+  C_TEMP_ABOVE,         // int16 tenths of °C
+  C_TEMP_BELOW,         // int16 tenths of °C
+  A_ON = 0x20,
+  A_OFF,
+  A_TOGGLE,
+  A_BLINK,              // uint16 duration in s, 0 for the current duration
+  A_PUBLISH,            // topic string, payload string
+  A_PORTAL,
+};
+
+const char* const paramKeys[] = {"rules", NULL};
+
+// The switch states in the same order as their values in switches.h
+const char* const GESTURE_NAMES[] = {"off", "on", "offonoff", "onoffon", "click", "long", "double", NULL};
+
+// The program being executed
+uint8_t program[MAX_PROGRAM_SIZE];
+uint16_t programLength = 0;
+uint8_t nbRules = 0;
+uint32_t programHash = 0;       // Hash of the source of the program
+bool programLoaded = false;
+uint32_t topicsHash = 2166136261UL;
+
+// The state of the rules
+unsigned long lastTimerTime[MAX_RULES];
+int16_t lastTemperature = 0;
+bool temperatureKnown = false;
+
+// The event being processed
+struct Event
+{
+  uint8_t trigger;
+  uint8_t switchID;
+  uint8_t state;
+  int16_t previous;
+  int16_t current;
+  const char* topic;
+  const char* payload;
+};
+
+
+///////////////////////////////////////////////////////////////////////////
+// Compiler                                                              //
+///////////////////////////////////////////////////////////////////////////
+
+const char* sourceStart;
+const char* source;
+uint16_t errorOffset;
+char token[MAX_TOKEN_LENGTH];
+uint8_t compiled[MAX_PROGRAM_SIZE];
+uint16_t compiledLength;
+uint8_t compiledRules;
+const char* compileError;
+
+void setError(const char* error)
+{
+  if (compileError == NULL)
+  {
+    compileError = error;
+    errorOffset = source - sourceStart;
+  }
+}
+
+// Read the next token, ',' and ';' are tokens by themselves
+void nextToken()
+{
+  while (*source == ' ' || *source == '\t' || *source == '\r' || *source == '\n')
+    source++;
+  uint8_t len = 0;
+  if (*source == ',' || *source == ';')
+    token[len++] = *source++;
+  else
+  {
+    while (*source != 0x00 && strchr(" \t\r\n,;", *source) == NULL)
+    {
+      if (len == MAX_TOKEN_LENGTH - 1)
+      {
+        setError("token too long");
+        break;
+      }
+      token[len++] = *source++;
+    }
+  }
+  token[len] = 0x00;
+}
+
+bool isToken(const char* str)
+{
+  return strcmp(token, str) == 0;
+}
+
+void emit(uint8_t b)
+{
+  if (compiledLength >= MAX_PROGRAM_SIZE)
+  {
+    setError("program too large");
+    return;
+  }
+  compiled[compiledLength++] = b;
+}
+
+void emitInt16(int16_t v)
+{
+  emit((uint8_t)v);
+  emit((uint8_t)(v >> 8));
+}
+
+void emitString(const char* str)
+{
+  uint8_t len = strlen(str);
+  emit(len);
+  for (uint8_t i = 0; i < len; i++)
+    emit(str[i]);
+  emit(0x00);
+}
+
+// Temperature in °C converted to tenths of °C
+void emitTemperature()
+{
+  char* end;
+  double t = strtod(token, &end);
+  if (token[0] == 0x00 || *end != 0x00 || t < -100 || t > 200)
+    setError("bad temperature");
+  emitInt16((int16_t)(t * 10));
+}
+
+uint16_t parseInteger(uint32_t maxValue)
+{
+  char* end;
+  uint32_t v = strtoul(token, &end, 10);
+  if (token[0] == 0x00 || *end != 0x00 || v > maxValue)
+    setError("bad number");
+  return v;
+}
+
+// The current token should be the first of the trigger
+void compileTrigger()
+{
+  if (isToken("switch"))
+  {
+    nextToken();
+    uint8_t switchID = parseInteger(2);
+    nextToken();
+    uint8_t state = 0;
+    while (GESTURE_NAMES[state] != NULL && !isToken(GESTURE_NAMES[state]))
+      state++;
+    if (GESTURE_NAMES[state] == NULL)
+      setError("unknown switch state");
+    emit(T_SWITCH);
+    emit(switchID);
+    emit(state);
+    nextToken();
+  }
+  else if (isToken("temp"))
+  {
+    nextToken();
+    if (isToken("above"))
+      emit(T_TEMP_ABOVE);
+    else if (isToken("below"))
+      emit(T_TEMP_BELOW);
+    else
+      setError("expecting above or below");
+    nextToken();
+    emitTemperature();
+    nextToken();
+  }
+  else if (isToken("overheat"))
+  {
+    emit(T_OVERHEAT);
+    nextToken();
+  }
+  else if (isToken("every"))
+  {
+    nextToken();
+    uint16_t period = parseInteger(65535);
+    if (period == 0)
+      setError("bad period");
+    emit(T_EVERY);
+    emitInt16(period);
+    nextToken();
+  }
+  else if (isToken("mqtt"))
+  {
+    emit(T_MQTT);
+    nextToken();
+    if (token[0] == 0x00 || isToken("if") || isToken("then"))
+      setError("expecting a topic");
+    emitString(token);
+    nextToken();
+    // The payload is optional
+    if (!isToken("if") && !isToken("then"))
+    {
+      emitString(token);
+      nextToken();
+    }
+    else
+      emitString("");
+  }
+  else
+    setError("unknown trigger");
+}
+
+void compileCondition()
+{
+  if (isToken("light"))
+  {
+    nextToken();
+    if (isToken("on"))
+      emit(C_LIGHT_ON);
+    else if (isToken("off"))
+      emit(C_LIGHT_OFF);
+    else
+      setError("expecting on or off");
+  }
+  else if (isToken("temp"))
+  {
+    nextToken();
+    if (isToken("above"))
+      emit(C_TEMP_ABOVE);
+    else if (isToken("below"))
+      emit(C_TEMP_BELOW);
+    else
+      setError("expecting above or below");
+    nextToken();
+    emitTemperature();
+  }
+  else
+    setError("unknown condition");
+  nextToken();
+}
+
+void compileAction()
+{
+  if (isToken("on"))
+    emit(A_ON);
+  else if (isToken("off"))
+    emit(A_OFF);
+  else if (isToken("toggle"))
+    emit(A_TOGGLE);
+  else if (isToken("portal"))
+    emit(A_PORTAL);
+  else if (isToken("blink"))
+  {
+    emit(A_BLINK);
+    nextToken();
+    // The duration is optional
+    if (token[0] >= '0' && token[0] <= '9')
+      emitInt16(parseInteger(65535));
+    else
+    {
+      emitInt16(0);
+      return;
+    }
+  }
+  else if (isToken("publish"))
+  {
+    emit(A_PUBLISH);
+    nextToken();
+    if (token[0] == 0x00 || isToken(",") || isToken(";"))
+      setError("expecting a topic");
+    emitString(token);
+    nextToken();
+    if (token[0] == 0x00 || isToken(",") || isToken(";"))
+      setError("expecting a payload");
+    emitString(token);
+  }
+  else
+    setError("unknown action");
+  nextToken();
+}
+
+void compileRule()
+{
+  uint16_t start = compiledLength;
+  emit(0);                      // Length of the rule, set at the end
+  compileTrigger();
+  if (isToken("if"))
+  {
+    do
+    {
+      nextToken();
+      compileCondition();
+    } while (isToken("and") && compileError == NULL);
+  }
+  if (!isToken("then"))
+    setError("expecting then");
+  do
+  {
+    nextToken();
+    compileAction();
+  } while (isToken(",") && compileError == NULL);
+  if (!isToken(";") && token[0] != 0x00)
+    setError("expecting ; or the end of the rules");
+  if (compiledLength - start > 255)
+    setError("rule too long");
+  if (compileError == NULL)
+    compiled[start] = compiledLength - start;
+}
+
+bool compile(const char* str)
+{
+  sourceStart = str;
+  source = str;
+  compiledLength = 0;
+  compiledRules = 0;
+  compileError = NULL;
+  nextToken();
+  while (token[0] != 0x00 && compileError == NULL)
+  {
+    if (isToken(";"))
+    {
+      nextToken();
+      continue;
+    }
+    if (compiledRules == MAX_RULES)
+    {
+      setError("too many rules");
+      break;
+    }
+    compiledRules++;
+    compileRule();
+  }
+  if (compileError != NULL)
+  {
+    logging::getLogStream().printf("rules: error in rule %d at character %d: %s\n", compiledRules, errorOffset, compileError);
+    return false;
+  }
+  logging::getLogStream().printf("rules: %d rules compiled in %d bytes\n", compiledRules, compiledLength);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Interpreter                                                           //
+///////////////////////////////////////////////////////////////////////////
+
+int16_t readInt16(const uint8_t* pc)
+{
+  return (int16_t)((uint16_t)pc[0] | ((uint16_t)pc[1] << 8));
+}
+
+// Return the string at pc and move pc after it
+const char* readString(const uint8_t* &pc)
+{
+  const char* str = (const char*)pc + 1;
+  pc += pc[0] + 2;
+  return str;
+}
+
+// Size of the instruction at pc, 0 if it is not valid
+uint8_t instructionSize(const uint8_t* pc, const uint8_t* end)
+{
+  uint8_t size;
+  switch (pc[0])
+  {
+    case T_OVERHEAT: case C_LIGHT_ON: case C_LIGHT_OFF: case A_ON: case A_OFF: case A_TOGGLE: case A_PORTAL:
+    size = 1;
+    break;
+    case T_SWITCH: case T_TEMP_ABOVE: case T_TEMP_BELOW: case T_EVERY: case C_TEMP_ABOVE: case C_TEMP_BELOW: case A_BLINK:
+    size = 3;
+    break;
+    case T_MQTT: case A_PUBLISH:
+    {
+      // Two strings
+      const uint8_t* p = pc + 1;
+      for (uint8_t i = 0; i < 2; i++)
+      {
+        if (p >= end || p + p[0] + 2 > end || p[p[0] + 1] != 0x00)
+          return 0;
+        p += p[0] + 2;
+      }
+      return p - pc;
+    }
+    default:
+    return 0;
+  }
+  return (pc + size <= end) ? size : 0;
+}
+
+// Check that a program read from the file cannot make the interpreter read out of it
+bool verify(const uint8_t* code, uint16_t length, uint8_t count)
+{
+  const uint8_t* rule = code;
+  for (uint8_t r = 0; r < count; r++)
+  {
+    if (rule >= code + length || rule[0] < 3 || rule + rule[0] > code + length)
+      return false;
+    const uint8_t* end = rule + rule[0];
+    const uint8_t* pc = rule + 1;
+    if (pc[0] < T_SWITCH || pc[0] > T_EVERY)
+      return false;
+    // One trigger, then the conditions, then the actions
+    uint8_t previous = pc[0];
+    while (pc < end)
+    {
+      uint8_t size = instructionSize(pc, end);
+      if (size == 0)
+        return false;
+      if (pc != rule + 1 && (pc[0] <= T_EVERY || (pc[0] < A_ON && previous >= A_ON)))
+        return false;
+      previous = pc[0];
+      pc += size;
+    }
+    rule = end;
+  }
+  return rule == code + length;
+}
+
+// Check the trigger at pc against the event and move pc after the trigger
+bool matchTrigger(const uint8_t* &pc, const Event &event, uint8_t index)
+{
+  uint8_t trigger = *pc++;
+  bool match = (trigger == event.trigger);
+  switch (trigger)
+  {
+    case T_SWITCH:
+    match = match && pc[0] == event.switchID && pc[1] == event.state;
+    pc += 2;
+    break;
+    case T_TEMP_ABOVE:
+    // Only when the threshold is crossed
+    match = match && event.previous <= readInt16(pc) && event.current > readInt16(pc);
+    pc += 2;
+    break;
+    case T_TEMP_BELOW:
+    match = match && event.previous >= readInt16(pc) && event.current < readInt16(pc);
+    pc += 2;
+    break;
+    case T_EVERY:
+    if (match && millis() - lastTimerTime[index] >= (uint16_t)readInt16(pc) * 1000UL)
+      lastTimerTime[index] = millis();
+    else
+      match = false;
+    pc += 2;
+    break;
+    case T_MQTT:
+    {
+      const char* topic = readString(pc);
+      const char* payload = readString(pc);
+      match = match && strcmp(topic, event.topic) == 0 && (payload[0] == 0x00 || strcmp(payload, event.payload) == 0);
+      break;
+    }
+  }
+  return match;
+}
+
+void executeRule(const uint8_t* pc, const uint8_t* end)
+{
+  // The conditions
+  int16_t temperature = (int16_t)(switches::getTemperature() * 10);
+  while (pc < end && *pc < A_ON)
+  {
+    bool ok = true;
+    switch (*pc)
+    {
+      case C_LIGHT_ON:
+      ok = light::lightIsOn();
+      break;
+      case C_LIGHT_OFF:
+      ok = !light::lightIsOn();
+      break;
+      case C_TEMP_ABOVE:
+      ok = temperature > readInt16(pc + 1);
+      break;
+      case C_TEMP_BELOW:
+      ok = temperature < readInt16(pc + 1);
+      break;
+    }
+    uint8_t size = instructionSize(pc, end);
+    if (!ok || size == 0)
+      return;
+    pc += size;
+  }
+
+  // The actions, stopping at an instruction that is not valid
+  while (pc < end)
+  {
+    uint8_t size = instructionSize(pc, end);
+    if (size == 0)
+      return;
+    const uint8_t* next = pc + size;
+    uint8_t op = *pc++;
+    switch (op)
+    {
+      case A_ON:
+      light::lightOn(false, light::SOURCE_RULES);
+      break;
+      case A_OFF:
+      light::lightOff(light::SOURCE_RULES);
+      break;
+      case A_TOGGLE:
+      light::lightToggle(false, light::SOURCE_RULES);
+      break;
+      case A_PORTAL:
+      wifi::requestPortal();
+      break;
+      case A_BLINK:
+      {
+        uint16_t duration = readInt16(pc);
+        pc += 2;
+        if (duration > 0)
+        {
+          char str[6];
+          sprintf(str, "%u", duration);
+          light::setBlinkingDuration(str);
+        }
+        light::startBlinking();
+        break;
+      }
+      case A_PUBLISH:
+      {
+        const char* topic = readString(pc);
+        const char* payload = readString(pc);
+        mqtt::publishMQTT(topic, payload);
+        break;
+      }
+      default:
+      // A trigger or a condition among the actions
+      return;
+    }
+    pc = next;
+  }
+}
+
+// Execute the rules triggered by the event, in their order
+// Return the number of rules triggered
+uint8_t run(const Event &event)
+{
+  uint8_t triggered = 0;
+  const uint8_t* rule = program;
+  for (uint8_t index = 0; index < nbRules; index++)
+  {
+    const uint8_t* end = rule + rule[0];
+    const uint8_t* pc = rule + 1;
+    if (matchTrigger(pc, event, index))
+    {
+      logging::getLogStream().printf("rules: rule %d triggered\n", index + 1);
+      executeRule(pc, end);
+      triggered++;
+    }
+    rule = end;
+  }
+  return triggered;
+}
+
+void onGesture(uint8_t switchID, uint8_t state)
+{
+  Event event = {T_SWITCH, switchID, state};
+  run(event);
+}
+
+void onTemperature(float temperature)
+{
+  int16_t current = (int16_t)(temperature * 10);
+  if (temperatureKnown)
+  {
+    Event event = {T_TEMP_ABOVE, 0, 0, lastTemperature, current};
+    run(event);
+    event.trigger = T_TEMP_BELOW;
+    run(event);
+  }
+  lastTemperature = current;
+  temperatureKnown = true;
+}
+
+void onOverheat()
+{
+  Event event = {T_OVERHEAT};
+  run(event);
+}
+
+bool onMqttMessage(const char* topic, const char* payload)
+{
+  // The topic can be in the buffer of the MQTT client, which is overwritten when an action publishes.
+  // No rule has a longer topic than a token.
+  if (strlen(topic) >= MAX_TOKEN_LENGTH)
+    return false;
+  char eventTopic[MAX_TOKEN_LENGTH];
+  strcpy(eventTopic, topic);
+  Event event = {T_MQTT, 0, 0, 0, 0, eventTopic, payload};
+  return run(event) > 0;
+}
+
+uint8_t getNbMqttTopics()
+{
+  uint8_t count = 0;
+  const uint8_t* rule = program;
+  for (uint8_t index = 0; index < nbRules; index++)
+  {
+    if (rule[1] == T_MQTT)
+      count++;
+    rule += rule[0];
+  }
+  return count;
+}
+
+const char* getMqttTopic(uint8_t n)
+{
+  const uint8_t* rule = program;
+  for (uint8_t index = 0; index < nbRules; index++)
+  {
+    if (rule[1] == T_MQTT && n-- == 0)
+      return (const char*)rule + 3;
+    rule += rule[0];
+  }
+  return NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Storage                                                               //
+///////////////////////////////////////////////////////////////////////////
+
+// Load the compiled program if it has been compiled from the same source
+bool load(uint32_t hash)
+{
+  File file = LittleFS.open(RULES_FILE, "r");
+  if (!file)
+    return false;
+  uint8_t header[RULES_HEADER_SIZE];
+  bool ok = (file.read(header, RULES_HEADER_SIZE) == RULES_HEADER_SIZE);
+  uint16_t length = header[8] | (header[9] << 8);
+  ok = ok && header[0] == 'R' && header[1] == 'B' && header[2] == RULES_VERSION && header[3] <= MAX_RULES;
+  ok = ok && (((uint32_t)header[4]) | ((uint32_t)header[5] << 8) | ((uint32_t)header[6] << 16) | ((uint32_t)header[7] << 24)) == hash;
+  ok = ok && length <= MAX_PROGRAM_SIZE && file.read(compiled, length) == length;
+  file.close();
+  if (!ok || !verify(compiled, length, header[3]))
+    return false;
+  compiledLength = length;
+  compiledRules = header[3];
+  return true;
+}
+
+void save(uint32_t hash)
+{
+  File file = LittleFS.open(RULES_FILE, "w");
+  if (!file)
+  {
+    logging::getLogStream().printf("rules: cannot write %s\n", RULES_FILE);
+    return;
+  }
+  uint8_t header[RULES_HEADER_SIZE] = {'R', 'B', RULES_VERSION, compiledRules,
+                                       (uint8_t)hash, (uint8_t)(hash >> 8), (uint8_t)(hash >> 16), (uint8_t)(hash >> 24),
+                                       (uint8_t)compiledLength, (uint8_t)(compiledLength >> 8)};
+  file.write(header, RULES_HEADER_SIZE);
+  file.write(compiled, compiledLength);
+  file.close();
+}
+
+void updateParams()
+{
+  logging::getLogStream().println("rules: updateParams");
+  const char* str = wifi::getParamValueFromID("rules");
+  uint32_t hash = helpers::fnv1a(str);
+  if (programLoaded && hash == programHash)
+    return;
+
+  if (str == NULL)
+  {
+    compiledLength = 0;
+    compiledRules = 0;
+    LittleFS.remove(RULES_FILE);
+  }
+  else if (load(hash))
+    logging::getLogStream().printf("rules: %d rules loaded from %s\n", compiledRules, RULES_FILE);
+  else if (compile(str))
+    save(hash);
+  else
+    return;             // The previous rules are kept
+
+  memcpy(program, compiled, compiledLength);
+  programLength = compiledLength;
+  nbRules = compiledRules;
+  programHash = hash;
+  programLoaded = true;
+  for (uint8_t i = 0; i < MAX_RULES; i++)
+    lastTimerTime[i] = millis();
+
+  // Subscribe to the topics of the rules
+  uint32_t newTopicsHash = 2166136261UL;
+  for (uint8_t i = 0; i < getNbMqttTopics(); i++)
+    newTopicsHash = helpers::fnv1a(getMqttTopic(i), newTopicsHash);
+  if (newTopicsHash != topicsHash)
+  {
+    topicsHash = newTopicsHash;
+    mqtt::updateSubscriptions();
+  }
+}
+
+void setup()
+{
+  // The timers are checked every second
+  scheduler::addTask("rules", handle, scheduler::PRIORITY_NORMAL, 1000, 2000);
+}
+
+void handle()
+{
+  if (nbRules == 0)
+    return;
+  Event event = {T_EVERY};
+  run(event);
+}
+
+}
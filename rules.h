@@ -0,0 +1,26 @@
+#ifndef RULES
+#define RULES
+
+#include <Arduino.h>
+
+namespace rules
+{
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
+  // The events triggering the rules
+  void onGesture(uint8_t switchID, uint8_t state);
+  void onTemperature(float temperature);
+  void onOverheat();
+  bool onMqttMessage(const char* topic, const char* payload);
+
+  // The topics of the rules with a MQTT trigger
+  uint8_t getNbMqttTopics();
+  const char* getMqttTopic(uint8_t index);
+
+  void updateParams();
+  void setup();
+  void handle();
+}
+
+#endif
@@ -0,0 +1,486 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <coredecls.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "light.h"
+#include "schedule.h"
+#include "scheduler.h"
+
+
+namespace schedule
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Schedule given in the parameter "schedule", entries separated by ';' //
+//   <minute> <hour> <day of week> <on|off|toggle>                        //
+// The fields are '*', a value, a range a-b, a step */n or a list of      //
+// them separated by ','. The days of week are 0 (Sunday) to 6          //
+// Example: "30 7 1-5 on; 0 23 * off"                                    //
+// The entries are compiled into bit masks and sorted by their next     //
+// firing time, only the first deadline is checked in the loop           //
+///////////////////////////////////////////////////////////////////////////
+
+#define MAX_SCHEDULE_ENTRIES  16
+#define SCHEDULE_LENGTH       250             // Length of the parameter schedule
+#define CLOCK_FILE            "/clock.bin"
+#define CLOCK_MAGIC           0x434C4B31      // "CLK1"
+#define CLOCK_SAVE_PERIOD     60000           // In ms, the clock is saved in the RTC memory for the reboots
+#define MAX_DRIFT_PPM         500
+#define MIN_DRIFT_INTERVAL    600000          // In ms, the drift is measured between syncs at least this far apart
+#define MAX_CATCH_UP          120             // In s, the entries missed by a restored clock lagging by less are fired
+
+enum { ACTION_ON, ACTION_OFF, ACTION_TOGGLE };
+const char* const ACTION_NAMES[] = {"on", "off", "toggle", NULL};
+
+const char* const paramKeys[] = {"schedule", NULL};
+const char* const clockKeys[] = {"ntpServer", "timezone", NULL};
+
+struct Entry
+{
+  uint64_t minutes;       // Bit n for the minute n
+  uint32_t hours;
+  uint8_t days;           // Bit 0 for Sunday
+  uint8_t action;
+  time_t next;            // Next firing time, 0 if never
+};
+Entry entries[MAX_SCHEDULE_ENTRIES];
+uint8_t nbEntries = 0;
+uint8_t order[MAX_SCHEDULE_ENTRIES];      // The entries sorted by their next firing time
+bool tableValid = false;                  // False when the table should be sorted again
+time_t tableStart = 0;                    // The firing times are computed after it when not 0, instead of the current time
+time_t lastFiringTime = 0;
+
+///////////////////////////////////////////////////////////////////////////
+// Clock                                                                 //
+// The time is kept as an epoch in ms at a reference millis() value.      //
+// It free-runs on millis() corrected by the drift measured between two   //
+// SNTP synchronizations. The drift is saved in LittleFS, the time in the //
+// RTC memory so that it survives the reboots without power loss         //
+///////////////////////////////////////////////////////////////////////////
+
+struct ClockRecord
+{
+  uint32_t magic;
+  uint32_t timeLow;       // Epoch in ms
+  uint32_t timeHigh;
+  int32_t driftPpm;
+  uint32_t check;
+};
+
+int64_t baseTimeMs = 0;         // Epoch in ms at baseMillis, 0 if the clock is not set
+uint32_t baseMillis = 0;
+int32_t driftPpm = 0;           // Positive if millis() is slower than the real time
+int32_t savedDriftPpm = 0;
+int64_t lastSyncTimeMs = 0;     // Free-running time at the last SNTP synchronization
+uint32_t lastSyncMillis = 0;
+uint32_t lastSaveMillis = 0;
+volatile bool clockSynchronized = false;
+bool clockProvisional = false;  // Restored after a reboot, it lags by up to the save period until the next SNTP sync
+
+int64_t getTimeMs()
+{
+  if (baseTimeMs == 0)
+    return 0;
+  int64_t elapsed = (uint32_t)(millis() - baseMillis);
+  return baseTimeMs + elapsed + elapsed * driftPpm / 1000000;
+}
+
+time_t getTime()
+{
+  return getTimeMs() / 1000;
+}
+
+void setTimeMs(int64_t timeMs)
+{
+  baseTimeMs = timeMs;
+  baseMillis = millis();
+}
+
+uint32_t recordCheck(const ClockRecord &r)
+{
+  return (r.magic ^ r.timeLow ^ r.timeHigh ^ (uint32_t)r.driftPpm) * 2654435761UL;
+}
+
+void writeClockRecord(ClockRecord &r)
+{
+  int64_t now = getTimeMs();
+  // New reference so that millis() does not wrap around between two references
+  setTimeMs(now);
+  r = {CLOCK_MAGIC, (uint32_t)now, (uint32_t)(now >> 32), driftPpm, 0};
+  r.check = recordCheck(r);
+  ESP.rtcUserMemoryWrite(RTC_CLOCK_BLOCK, (uint32_t*)&r, sizeof(r));
+}
+
+void saveClock()
+{
+  ClockRecord r;
+  writeClockRecord(r);
+
+  // The drift is written to the flash only when it has changed
+  if (abs(driftPpm - savedDriftPpm) >= 2)
+  {
+    File file = LittleFS.open(CLOCK_FILE, "w");
+    if (file)
+    {
+      file.write((const uint8_t*)&r, sizeof(r));
+      file.close();
+      savedDriftPpm = driftPpm;
+    }
+  }
+}
+
+void loadClock()
+{
+  ClockRecord r;
+  File file = LittleFS.open(CLOCK_FILE, "r");
+  if (file)
+  {
+    if (file.read((uint8_t*)&r, sizeof(r)) == sizeof(r) && r.magic == CLOCK_MAGIC && r.check == recordCheck(r) &&
+        abs(r.driftPpm) <= MAX_DRIFT_PPM)
+      driftPpm = savedDriftPpm = r.driftPpm;
+    file.close();
+  }
+
+  // The time is still in the RTC memory after a reboot without power loss
+  if (ESP.rtcUserMemoryRead(RTC_CLOCK_BLOCK, (uint32_t*)&r, sizeof(r)) && r.magic == CLOCK_MAGIC && r.check == recordCheck(r))
+  {
+    setTimeMs(((int64_t)r.timeHigh << 32) | r.timeLow);
+    clockProvisional = true;
+    logging::getLogStream().printf("schedule: clock restored after reboot, drift %d ppm, provisional until the next sync\n", driftPpm);
+  }
+}
+
+// Only the RTC memory is written, the file system may be unmounted
+void saveClockBeforeReboot()
+{
+  if (baseTimeMs == 0)
+    return;
+  ClockRecord r;
+  writeClockRecord(r);
+}
+
+// Called by the SNTP client, it should not do much
+void timeSet()
+{
+  clockSynchronized = true;
+}
+
+void synchronizeClock()
+{
+  clockSynchronized = false;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t sntpMs = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  int64_t freeRunningMs = getTimeMs();
+
+  // Drift measured over the time elapsed since the last synchronization
+  uint32_t elapsed = millis() - lastSyncMillis;
+  if (lastSyncTimeMs != 0 && freeRunningMs != 0 && elapsed >= MIN_DRIFT_INTERVAL)
+  {
+    int32_t measured = (int32_t)((sntpMs - freeRunningMs) * 1000000 / (int64_t)elapsed);
+    // Only half of the error is corrected since a single measure includes the network delays
+    int32_t newDrift = driftPpm + measured / 2;
+    if (newDrift > MAX_DRIFT_PPM)
+      newDrift = MAX_DRIFT_PPM;
+    if (newDrift < -MAX_DRIFT_PPM)
+      newDrift = -MAX_DRIFT_PPM;
+    driftPpm = newDrift;
+  }
+  logging::getLogStream().printf("schedule: clock synchronized, offset %d ms, drift %d ppm\n",
+                                 freeRunningMs != 0 ? (int)(sntpMs - freeRunningMs) : 0, driftPpm);
+  setTimeMs(sntpMs);
+  lastSyncTimeMs = sntpMs;
+  lastSyncMillis = millis();
+  // The next firing times are computed again with the new time
+  tableValid = false;
+  if (clockProvisional)
+  {
+    // The entries missed while the restored clock was lagging are fired now,
+    // the ones fired while it was ahead are not fired again
+    time_t provisional = freeRunningMs / 1000;
+    time_t now = sntpMs / 1000;
+    if (provisional < now && now - provisional <= MAX_CATCH_UP)
+      tableStart = provisional;
+    else if (lastFiringTime > now)
+      tableStart = lastFiringTime;
+    clockProvisional = false;
+  }
+  saveClock();
+}
+
+void printClock()
+{
+  time_t now = getTime();
+  if (now == 0)
+  {
+    logging::getLogStream().println("schedule: clock not set");
+    return;
+  }
+  struct tm tm;
+  localtime_r(&now, &tm);
+  logging::getLogStream().printf("schedule: %04d-%02d-%02d %02d:%02d:%02d, drift %d ppm, last sync %lu s ago, %d entries, next in %lu s\n",
+                                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, driftPpm,
+                                 lastSyncTimeMs != 0 ? (unsigned long)((millis() - lastSyncMillis) / 1000) : 0UL, nbEntries,
+                                 (unsigned long)(getTimeToNextDeadline() / 1000));
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Schedule table                                                        //
+///////////////////////////////////////////////////////////////////////////
+
+// Parse a field like "*", "5", "1-5", "*/15" or "0,30" into a bit mask
+bool parseField(const char* str, uint8_t minValue, uint8_t maxValue, uint64_t &mask)
+{
+  mask = 0;
+  while (*str != 0x00)
+  {
+    uint32_t from = minValue, to = maxValue, step = 1;
+    char* end = (char*)str;
+    if (*str == '*')
+      end++;
+    else
+    {
+      from = to = strtoul(str, &end, 10);
+      if (end == str)
+        return false;
+      if (*end == '-')
+      {
+        str = end + 1;
+        to = strtoul(str, &end, 10);
+        if (end == str)
+          return false;
+      }
+    }
+    if (*end == '/')
+    {
+      str = end + 1;
+      step = strtoul(str, &end, 10);
+      if (end == str || step == 0)
+        return false;
+    }
+    if (from < minValue || to > maxValue || from > to)
+      return false;
+    for (uint32_t v = from; v <= to; v += step)
+      mask |= 1ULL << v;
+    if (*end == ',')
+      end++;
+    else if (*end != 0x00)
+      return false;
+    str = end;
+  }
+  return mask != 0;
+}
+
+// Return the first time after "after" matching the entry, 0 if none
+time_t nextFiringTime(const Entry &e, time_t after)
+{
+  time_t t = after - (after % 60) + 60;
+  struct tm tm;
+  localtime_r(&t, &tm);
+  // At most 8 days, 24 hours and 60 minutes to look at
+  for (uint16_t i = 0; i < 8 + 24 + 60 + 2; i++)
+  {
+    if ((e.days & (1 << tm.tm_wday)) == 0)
+    {
+      tm.tm_mday++;
+      tm.tm_hour = 0;
+      tm.tm_min = 0;
+    }
+    else if ((e.hours & (1UL << tm.tm_hour)) == 0)
+    {
+      tm.tm_hour++;
+      tm.tm_min = 0;
+    }
+    else if ((e.minutes & (1ULL << tm.tm_min)) == 0)
+      tm.tm_min++;
+    else
+      return t;
+    // Normalized by mktime, with the daylight saving time of the new date
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    t = mktime(&tm);
+    localtime_r(&t, &tm);
+  }
+  return 0;
+}
+
+// Compute all the firing times and sort the entries
+void buildTable()
+{
+  time_t now = (tableStart != 0) ? tableStart : getTime();
+  tableStart = 0;
+  for (uint8_t i = 0; i < nbEntries; i++)
+  {
+    entries[i].next = nextFiringTime(entries[i], now);
+    // Insertion sort, the table is small
+    uint8_t j = i;
+    while (j > 0 && entries[order[j - 1]].next > entries[i].next)
+    {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+  // The entries never firing are at the beginning, they are skipped
+  tableValid = true;
+}
+
+// Move the first entry to its new place after its firing time has changed
+void reschedule()
+{
+  uint8_t first = order[0];
+  uint8_t j = 0;
+  while (j + 1 < nbEntries && entries[order[j + 1]].next < entries[first].next)
+  {
+    order[j] = order[j + 1];
+    j++;
+  }
+  order[j] = first;
+}
+
+void execute(const Entry &e)
+{
+  logging::getLogStream().printf("schedule: %s\n", ACTION_NAMES[e.action]);
+  switch (e.action)
+  {
+    case ACTION_ON:
+    // The auto-off timer applies as for the other commands
+    light::lightOn(false, light::SOURCE_SCHEDULE);
+    break;
+    case ACTION_OFF:
+    light::lightOff(light::SOURCE_SCHEDULE);
+    break;
+    case ACTION_TOGGLE:
+    light::lightToggle(false, light::SOURCE_SCHEDULE);
+    break;
+  }
+}
+
+// Index in order[] of the first entry with a firing time
+uint8_t firstEntry()
+{
+  uint8_t i = 0;
+  while (i < nbEntries && entries[order[i]].next == 0)
+    i++;
+  return i;
+}
+
+uint32_t getTimeToNextDeadline()
+{
+  time_t now = getTime();
+  uint8_t i = firstEntry();
+  if (now == 0 || !tableValid || i == nbEntries)
+    return 0xFFFFFFFF;
+  if (entries[order[i]].next <= now)
+    return 0;
+  return (entries[order[i]].next - now) * 1000 - getTimeMs() % 1000;
+}
+
+void updateParams()
+{
+  logging::getLogStream().println("schedule: updateParams");
+  nbEntries = 0;
+  tableValid = false;
+  const char* str = wifi::getParamValueFromID("schedule");
+  if (str == NULL)
+    return;
+
+  char copy[SCHEDULE_LENGTH + 1];
+  strncpy(copy, str, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = 0x00;
+  char* savePtr;
+  for (char* entryStr = strtok_r(copy, ";", &savePtr); entryStr != NULL; entryStr = strtok_r(NULL, ";", &savePtr))
+  {
+    char minuteStr[32], hourStr[32], dayStr[32], actionStr[8];
+    if (sscanf(entryStr, "%31s %31s %31s %7s", minuteStr, hourStr, dayStr, actionStr) != 4)
+    {
+      logging::getLogStream().printf("schedule: wrong entry \"%s\"\n", entryStr);
+      continue;
+    }
+    if (nbEntries == MAX_SCHEDULE_ENTRIES)
+    {
+      logging::getLogStream().println("schedule: too many entries");
+      break;
+    }
+    Entry &e = entries[nbEntries];
+    uint64_t hours, days;
+    uint8_t action = 0;
+    while (ACTION_NAMES[action] != NULL && strcmp(ACTION_NAMES[action], actionStr) != 0)
+      action++;
+    if (!parseField(minuteStr, 0, 59, e.minutes) || !parseField(hourStr, 0, 23, hours) ||
+        !parseField(dayStr, 0, 7, days) || ACTION_NAMES[action] == NULL)
+    {
+      logging::getLogStream().printf("schedule: wrong entry \"%s\"\n", entryStr);
+      continue;
+    }
+    e.hours = hours;
+    e.days = (days | (days >> 7)) & 0x7F;   // 7 is also Sunday
+    e.action = action;
+    e.next = 0;
+    nbEntries++;
+  }
+  logging::getLogStream().printf("schedule: %d entries\n", nbEntries);
+}
+
+void updateClockParams()
+{
+  logging::getLogStream().println("schedule: updateClockParams");
+  const char* tz = wifi::getParamValueFromID("timezone");
+  const char* server = wifi::getParamValueFromID("ntpServer");
+  if (tz == NULL)
+    tz = "UTC0";
+  if (server != NULL)
+    configTime(tz, server);
+  else
+  {
+    // Free-running clock, only the time zone is set
+    setenv("TZ", tz, 1);
+    tzset();
+  }
+  tableValid = false;
+}
+
+void setup()
+{
+  loadClock();
+  settimeofday_cb(timeSet);
+  scheduler::addTask("schedule", handle, scheduler::PRIORITY_NORMAL, 0, 2000, getTimeToNextDeadline);
+}
+
+void handle()
+{
+  unsigned long now = millis();
+  if (clockSynchronized)
+    synchronizeClock();
+  if (baseTimeMs != 0 && now - lastSaveMillis > CLOCK_SAVE_PERIOD)
+  {
+    lastSaveMillis = now;
+    saveClock();
+  }
+
+  if (nbEntries == 0 || baseTimeMs == 0)
+    return;
+  if (!tableValid)
+    buildTable();
+
+  // Only the first deadline is checked
+  uint8_t i = firstEntry();
+  if (i == nbEntries || entries[order[i]].next > getTime())
+    return;
+  Entry &e = entries[order[i]];
+  execute(e);
+  lastFiringTime = e.next;
+  e.next = nextFiringTime(e, e.next);
+  if (i == 0)
+    reschedule();
+  else
+    tableValid = false;
+}
+
+}
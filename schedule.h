@@ -0,0 +1,26 @@
+#ifndef SCHEDULE
+#define SCHEDULE
+
+#include <Arduino.h>
+
+namespace schedule
+{
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+  extern const char* const clockKeys[];
+
+  // Local time, 0 if the clock has never been set
+  time_t getTime();
+  // Time in ms before the next scheduled entry, 0xFFFFFFFF if none
+  uint32_t getTimeToNextDeadline();
+  void printClock();
+  // Keep the time in the RTC memory for a planned reboot
+  void saveClockBeforeReboot();
+
+  void setup();
+  void updateParams();
+  void updateClockParams();
+  void handle();
+}
+
+#endif
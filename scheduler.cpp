@@ -0,0 +1,248 @@
+#include <Arduino.h>
+
+#include <ESP8266WiFi.h>
+extern "C" {
+#include "gpio.h"
+}
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "switches.h"
+#include "watchdog.h"
+#include "scheduler.h"
+
+
+namespace scheduler
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Cooperative scheduler called by loop()                               //
+// At each pass, the due task with the highest priority is run, then the //
+// tasks are scanned again from the highest priority. So the high        //
+// priority tasks (switches, relay) run again between the lower priority //
+// ones (MQTT, web portal) instead of waiting for the end of the pass    //
+// In the idle mode, the loop sleeps after a pass until the next         //
+// deadline of the tasks, at most sleepMaxDelay. A switch interrupt ends //
+// the sleep early                                                       //
+///////////////////////////////////////////////////////////////////////////
+
+#define MAX_TASKS 12
+#define SLEEP_SLICE 10          // In ms, modem sleep is done by slices to check the wake up requests
+
+const char* const paramKeys[] = {"sleepMode", "sleepMaxDelay", NULL};
+
+struct Task
+{
+  const char* name;
+  void (*fn)();
+  uint8_t priority;
+  uint16_t periodMs;
+  uint16_t budgetUs;
+  uint32_t (*nextDeadline)();
+  bool ranInPass;
+  unsigned long lastRunTime;      // In ms
+  // Statistics
+  uint32_t runs;
+  uint32_t overruns;
+  uint32_t maxDurationUs;
+  uint64_t totalDurationUs;
+};
+
+// Sorted by priority, in the registration order for the same priority
+Task tasks[MAX_TASKS];
+uint8_t nbTasks = 0;
+uint32_t passes = 0;
+
+// Idle mode
+uint8_t sleepMode = SLEEP_NONE;
+uint16_t sleepMaxDelay = 100;
+bool awake = false;
+volatile bool wakeRequested = false;
+volatile uint32_t wakeRequestTime = 0;   // In us
+uint32_t idlePasses = 0;
+uint64_t idleTimeMs = 0;
+uint32_t wakeUps = 0;
+uint32_t maxWakeLatency = 0;             // In us
+uint64_t totalWakeLatency = 0;
+
+bool addTask(const char* name, void (*fn)(), uint8_t priority, uint16_t periodMs, uint16_t budgetUs,
+             uint32_t (*nextDeadline)())
+{
+  if (nbTasks == MAX_TASKS)
+  {
+    logging::getLogStream().printf("scheduler: no room for the task %s\n", name);
+    return false;
+  }
+  uint8_t i = nbTasks;
+  while (i > 0 && tasks[i - 1].priority > priority)
+  {
+    tasks[i] = tasks[i - 1];
+    i--;
+  }
+  tasks[i] = Task();
+  tasks[i].name = name;
+  tasks[i].fn = fn;
+  tasks[i].priority = priority;
+  tasks[i].periodMs = periodMs;
+  tasks[i].budgetUs = budgetUs;
+  tasks[i].nextDeadline = nextDeadline;
+  tasks[i].lastRunTime = millis();
+  nbTasks++;
+  return true;
+}
+
+void stayAwake()
+{
+  awake = true;
+}
+
+ICACHE_RAM_ATTR void wakeUp()
+{
+  if (!wakeRequested)
+  {
+    wakeRequestTime = micros();
+    wakeRequested = true;
+  }
+}
+
+uint32_t getIdlePasses()
+{
+  return idlePasses;
+}
+
+uint32_t getMaxWakeLatency()
+{
+  return maxWakeLatency;
+}
+
+void printStats()
+{
+  logging::getLogStream().printf("scheduler: %u passes, %u idle passes, idle %u%%, wake latency avg %u us max %u us\n",
+                                 passes, idlePasses, (unsigned int)(idleTimeMs * 100 / (millis() + 1)),
+                                 wakeUps > 0 ? (unsigned int)(totalWakeLatency / wakeUps) : 0, maxWakeLatency);
+  for (uint8_t i = 0; i < nbTasks; i++)
+  {
+    Task &t = tasks[i];
+    logging::getLogStream().printf(" %-10s prio %d period %5u ms budget %5u us: runs %u, avg %u us, max %u us, overruns %u\n",
+                                   t.name, t.priority, t.periodMs, t.budgetUs, t.runs,
+                                   t.runs > 0 ? (unsigned int)(t.totalDurationUs / t.runs) : 0, t.maxDurationUs, t.overruns);
+  }
+}
+
+void execute(Task &t)
+{
+  t.ranInPass = true;
+  t.lastRunTime = millis();
+  watchdog::enterStage(t.name);
+  uint32_t start = micros();
+  t.fn();
+  uint32_t duration = micros() - start;
+  watchdog::leaveStage();
+  t.runs++;
+  t.totalDurationUs += duration;
+  if (duration > t.maxDurationUs)
+    t.maxDurationUs = duration;
+  if (duration > t.budgetUs)
+    t.overruns++;
+  // Long enough to matter for the watchdog, the argument is the duration in ms
+  if (duration > 100000)
+    watchdog::breadcrumb(watchdog::CRUMB_TASK_OVERRUN, duration / 1000);
+}
+
+void updateParams()
+{
+  logging::getLogStream().println("scheduler: updateParams");
+  uint16_t mode = SLEEP_NONE;
+  helpers::convertToInteger(wifi::getParamValueFromID("sleepMode"), mode, 1);
+  uint16_t maxDelay = 100;
+  helpers::convertToInteger(wifi::getParamValueFromID("sleepMaxDelay"), maxDelay, 5);
+  sleepMode = (mode <= SLEEP_LIGHT) ? mode : SLEEP_NONE;
+  sleepMaxDelay = maxDelay;
+  // The light sleep is done by the SDK during delay() when the station is idle
+  WiFi.setSleepMode(sleepMode == SLEEP_LIGHT ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+}
+
+// Time in ms before a task has to run
+uint32_t getIdleTime()
+{
+  uint32_t idle = sleepMaxDelay;
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < nbTasks && idle > 0; i++)
+  {
+    Task &t = tasks[i];
+    uint32_t wait = idle;
+    if (t.periodMs > 0)
+    {
+      unsigned long elapsed = now - t.lastRunTime;
+      wait = (elapsed >= t.periodMs) ? 0 : t.periodMs - elapsed;
+    }
+    else if (t.nextDeadline != NULL)
+      wait = t.nextDeadline();
+    if (wait < idle)
+      idle = wait;
+  }
+  return idle;
+}
+
+void sleep()
+{
+  uint32_t idle = getIdleTime();
+  if (idle == 0)
+    return;
+  idlePasses++;
+  unsigned long start = millis();
+  if (sleepMode == SLEEP_LIGHT)
+  {
+    // The timer interrupt of the switches is stopped during the light sleep, the switch wakes up the CPU
+    switches::enableWakeUp();
+    delay(idle);
+    gpio_pin_wakeup_disable();
+  }
+  else
+  {
+    while (!wakeRequested && millis() - start < idle)
+      delay(min((uint32_t)SLEEP_SLICE, idle - (uint32_t)(millis() - start)));
+  }
+  idleTimeMs += millis() - start;
+}
+
+void run()
+{
+  passes++;
+  if (wakeRequested)
+  {
+    // Time between the interrupt and the start of the pass
+    uint32_t latency = micros() - wakeRequestTime;
+    wakeRequested = false;
+    wakeUps++;
+    totalWakeLatency += latency;
+    if (latency > maxWakeLatency)
+      maxWakeLatency = latency;
+  }
+  awake = false;
+  for (uint8_t i = 0; i < nbTasks; i++)
+    tasks[i].ranInPass = false;
+
+  while (true)
+  {
+    // The first due task is the one with the highest priority
+    unsigned long now = millis();
+    uint8_t i = 0;
+    while (i < nbTasks && (tasks[i].ranInPass || now - tasks[i].lastRunTime < tasks[i].periodMs))
+      i++;
+    if (i == nbTasks)
+      break;
+    execute(tasks[i]);
+
+    // The high priority tasks can run again after a task with a lower priority
+    if (tasks[i].priority != PRIORITY_HIGH)
+      for (uint8_t j = 0; j < nbTasks && tasks[j].priority == PRIORITY_HIGH; j++)
+        tasks[j].ranInPass = false;
+  }
+
+  if (sleepMode != SLEEP_NONE && !awake && !wakeRequested)
+    sleep();
+}
+
+}
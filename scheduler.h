@@ -0,0 +1,31 @@
+#ifndef SCHEDULER
+#define SCHEDULER
+
+#include <Arduino.h>
+
+namespace scheduler
+{
+  // The tasks with a higher priority run first and again after each task with a lower priority
+  enum { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW };
+  enum { SLEEP_NONE, SLEEP_MODEM, SLEEP_LIGHT };
+
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
+  // A period of 0 runs the task at each pass, the budget is only used for the statistics
+  // nextDeadline gives the time in ms before the task has work to do, for the idle mode
+  bool addTask(const char* name, void (*fn)(), uint8_t priority, uint16_t periodMs, uint16_t budgetUs,
+               uint32_t (*nextDeadline)()=NULL);
+  // For the tasks with pending work, the loop does not sleep after this pass
+  void stayAwake();
+  // From an interrupt, to end the sleep as soon as possible
+  ICACHE_RAM_ATTR void wakeUp();
+
+  uint32_t getIdlePasses();
+  uint32_t getMaxWakeLatency();
+  void printStats();
+  void updateParams();
+  void run();
+}
+
+#endif
@@ -9,6 +9,13 @@
 #include "mqtt.h"
 #include "light.h"
 #include "switches.h"
+#include "events.h"
+#include "udp.h"
+#include "rules.h"
+#include "schedule.h"
+#include "scheduler.h"
+#include "watchdog.h"
+#include "metrics.h"
 
 #include "LittleFS.h"
 
@@ -22,10 +29,21 @@ void setup()
   if (!LittleFS.begin())
     logging::getLogStream().println("Failed to mounted file system");
 
+  // Report of the last reset, before the modules start to leave breadcrumbs
+  watchdog::setup();
+
   // Setup for the switches and the light
   switches::setup();
   // Initialise the relay
   light::setup();
+  // Restore the clock kept during the reboot
+  schedule::setup();
+  // The tasks of the modules without hardware to initialise
+  logging::setup();
+  udp::setup();
+  rules::setup();
+  events::setup();
+  metrics::setup();
   // Fast blinking to show that the device is booting
   switches::enableBuiltinLedBlinking(switches::LED_FAST_BLINKING);
 
@@ -38,21 +56,8 @@ void setup()
 
 
 // the loop function runs over and over again forever
+// The modules have registered their tasks in their setup
 void loop()
 {   
-  wifi::handle();
-
-  // Process the telnet commands
-  // Interactive console for debugging
-  logging::handle();
-
-  // Process data for MQTT
-  mqtt::handle();
-
-  // Process serial data from the MCU
-  light::handle();
-
-  // Process the switches events
-  switches::handle();
-
+  scheduler::run();
 }
@@ -0,0 +1,135 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "light.h"
+#include "switches.h"
+#include "mqtt.h"
+#include "status.h"
+#include "watchdog.h"
+
+
+namespace status
+{
+
+/////////////////////////////////////////////////////////////////////////////////
+// JSON status served from a buffer rendered only when the state has changed  //
+// The values changing all the time (uptime, RSSI, heap) are written in slots //
+// of fixed width padded with spaces, so that they are updated in place        //
+/////////////////////////////////////////////////////////////////////////////////
+
+#define STATUS_BUFFER_SIZE 768
+
+char statusBuffer[STATUS_BUFFER_SIZE];
+uint16_t statusLength = 0;
+bool statusValid = false;
+
+// The offsets of the slots updated at each request
+uint16_t uptimeSlot = 0;
+uint16_t rssiSlot = 0;
+uint16_t heapSlot = 0;
+#define UPTIME_WIDTH 10
+#define RSSI_WIDTH   4
+#define HEAP_WIDTH   6
+
+// The state used for the last rendering
+struct Snapshot
+{
+  bool lightOn;
+  bool overheat;
+  bool mqttConnected;
+  uint8_t wattage;
+  int16_t temperature;      // In tenths of degree
+};
+Snapshot renderedSnapshot;
+
+void takeSnapshot(Snapshot &snapshot)
+{
+  memset(&snapshot, 0x00, sizeof(snapshot));
+  snapshot.lightOn = light::lightIsOn();
+  snapshot.overheat = switches::getOverheatingAlarm();
+  snapshot.mqttConnected = mqtt::isConnected();
+  snapshot.wattage = light::getWattage();
+  snapshot.temperature = (int16_t)(switches::getTemperature() * 10);
+}
+
+// Append text to the buffer
+void append(const char* str)
+{
+  uint16_t len = strlen(str);
+  if (statusLength + len >= STATUS_BUFFER_SIZE)
+    len = STATUS_BUFFER_SIZE - 1 - statusLength;
+  memcpy(&statusBuffer[statusLength], str, len);
+  statusLength += len;
+  statusBuffer[statusLength] = 0x00;
+}
+
+// Append a slot of spaces and return its offset
+uint16_t appendSlot(uint8_t width)
+{
+  uint16_t offset = statusLength;
+  if (statusLength + width >= STATUS_BUFFER_SIZE)
+    return offset;
+  memset(&statusBuffer[statusLength], ' ', width);
+  statusLength += width;
+  statusBuffer[statusLength] = 0x00;
+  return offset;
+}
+
+// Write the value right-aligned in its slot
+void writeSlot(uint16_t offset, uint8_t width, long value)
+{
+  char tmp[12];
+  int len = snprintf(tmp, sizeof(tmp), "%ld", value);
+  if (len > width || offset + width > statusLength)
+    return;
+  memset(&statusBuffer[offset], ' ', width - len);
+  memcpy(&statusBuffer[offset + width - len], tmp, len);
+}
+
+void render()
+{
+  takeSnapshot(renderedSnapshot);
+  char tmp[128];
+  snprintf(tmp, sizeof(tmp), "{\"light\":\"%s\",\"temperature\":%.1f,\"overheat\":%s,\"power\":%d,\"mqtt\":\"%s\",\"uptime\":",
+           renderedSnapshot.lightOn ? "ON" : "OFF", renderedSnapshot.temperature / 10.0,
+           renderedSnapshot.overheat ? "true" : "false", renderedSnapshot.wattage,
+           renderedSnapshot.mqttConnected ? "connected" : "disconnected");
+  statusLength = 0;
+  append(tmp);
+  uptimeSlot = appendSlot(UPTIME_WIDTH);
+  append(",\"rssi\":");
+  rssiSlot = appendSlot(RSSI_WIDTH);
+  append(",\"heap\":");
+  heapSlot = appendSlot(HEAP_WIDTH);
+  append(",\"lastReset\":");
+  append(watchdog::getReport());
+  append("}");
+  statusValid = true;
+}
+
+void handleStatusRequest()
+{
+  // Render again only if the state has changed
+  Snapshot snapshot;
+  takeSnapshot(snapshot);
+  if (!statusValid || memcmp(&snapshot, &renderedSnapshot, sizeof(snapshot)) != 0)
+    render();
+  writeSlot(uptimeSlot, UPTIME_WIDTH, millis() / 1000);
+  writeSlot(rssiSlot, RSSI_WIDTH, WiFi.RSSI());
+  writeSlot(heapSlot, HEAP_WIDTH, ESP.getFreeHeap());
+
+  ESP8266WebServer *server = wifi::getWebServer();
+  server->setContentLength(statusLength);
+  server->send(200, "application/json", "");
+  server->sendContent(statusBuffer, statusLength);
+}
+
+void bindServerCallback()
+{
+  wifi::getWebServer()->on("/status", handleStatusRequest);
+}
+
+}
@@ -0,0 +1,12 @@
+#ifndef DEVICE_STATUS
+#define DEVICE_STATUS
+
+#include <Arduino.h>
+
+namespace status
+{
+  void handleStatusRequest();
+  void bindServerCallback();
+}
+
+#endif
@@ -4,26 +4,41 @@
 #include "config.h"
 #include "mqtt.h"
 #include "switches.h"
+#include "events.h"
+#include "rules.h"
+#include "scheduler.h"
+#include "watchdog.h"
 #include "ESP8266TimerInterrupt.h"
+extern "C" {
+#include "gpio.h"
+}
 
 
 namespace switches {
 
-  #define TEMPERATURE_SENSOR A0
-
   #define TOGGLE_BUTTON 2
   #define PUSH_BUTTON   1
   
-  // The possible states for the switches for TOGGLE_BUTTON
-  #define BUTTON_OFF                  0
-  #define BUTTON_ON                   1
-  #define BUTTON_OFF_ON_OFF           2
-  #define BUTTON_ON_OFF_ON            3
-  // The possible states for the switches for PUSH_BUTTON
-  #define BUTTON_SHORT_CLICK          4
-  #define BUTTON_LONG_CLICK           5
-  #define BUTTON_DOUBLE_CLICK         6
-  char *BUTTON_STATE_STR[] = { "BUTTON_OFF", "BUTTON_ON",  "BUTTON_OFF_ON_OFF", "BUTTON_ON_OFF_ON", "BUTTON_SHORT_CLICK", "BUTTON_LONG_CLICK", "BUTTON_DOUBLE_CLICK"};
+  // In flash, copied with getButtonStateStr() before being printed
+  const char BUTTON_OFF_STR[] PROGMEM = "BUTTON_OFF";
+  const char BUTTON_ON_STR[] PROGMEM = "BUTTON_ON";
+  const char BUTTON_OFF_ON_OFF_STR[] PROGMEM = "BUTTON_OFF_ON_OFF";
+  const char BUTTON_ON_OFF_ON_STR[] PROGMEM = "BUTTON_ON_OFF_ON";
+  const char BUTTON_SHORT_CLICK_STR[] PROGMEM = "BUTTON_SHORT_CLICK";
+  const char BUTTON_LONG_CLICK_STR[] PROGMEM = "BUTTON_LONG_CLICK";
+  const char BUTTON_DOUBLE_CLICK_STR[] PROGMEM = "BUTTON_DOUBLE_CLICK";
+  const char* const BUTTON_STATE_STR[] PROGMEM = { BUTTON_OFF_STR, BUTTON_ON_STR, BUTTON_OFF_ON_OFF_STR, BUTTON_ON_OFF_ON_STR,
+                                                   BUTTON_SHORT_CLICK_STR, BUTTON_LONG_CLICK_STR, BUTTON_DOUBLE_CLICK_STR};
+
+  #define BUTTON_STATE_STR_SIZE 20      // The longest name with the null character
+
+  // Copy the name of the state into the buffer of BUTTON_STATE_STR_SIZE bytes given
+  const char* getButtonStateStr(uint8_t state, char* buffer)
+  {
+    strncpy_P(buffer, (const char*)pgm_read_ptr(&BUTTON_STATE_STR[state]), BUTTON_STATE_STR_SIZE - 1);
+    buffer[BUTTON_STATE_STR_SIZE - 1] = 0x00;
+    return buffer;
+  }
 
   
   #define ALREADY_PUBLISHED           255
@@ -42,11 +57,15 @@ namespace switches {
   #define LONG_CLICK_DURATION 20      // 500 ms to detect long click
   #define DEBOUNCE_DURATION   4       // 4: 100 ms. If this value is too large, it does not detect double click
   
+  const char* const paramKeys[] = {"switchType", "defaultReleaseState", NULL};
+
   ESP8266Timer ITimer;      // For the builtin Leb blinking
 
   float temperature;        // Internal temperature
   bool overheatingAlarm = false;
   bool mqttOverheatingAlarm = false;
+  bool postedOverheatingAlarm = false;  // Last alarm state sent to the /events clients
+  int16_t postedTemperature = 0;        // Last temperature sent to the /events clients, in tenth of °C
 
   // The switch parameters
   volatile uint8_t switchType=TOGGLE_BUTTON;
@@ -57,6 +76,7 @@ namespace switches {
   // Getter
   float &getTemperature(){return temperature;}
   bool &getTemperatureLogging(){return temperatureLogging;}
+  bool &getOverheatingAlarm(){return overheatingAlarm;}
   
   // For the temperature
   unsigned long prevTime = millis();
@@ -68,26 +88,16 @@ namespace switches {
   unsigned long ledOnTime=0;
 
 
-  // For computing the current state for the switch 
-  #ifdef SHELLY_SW0
-  volatile uint8_t sw0StateFrame[5];
-  volatile uint8_t sw0StateFrameDuration[5];
-  #endif
+  // For computing the current state for the switches, indexed by the switch ID of the board traits
+  volatile uint8_t swStateFrame[Board::NB_SWITCH_IDS][5];
+  volatile uint8_t swStateFrameDuration[Board::NB_SWITCH_IDS][5];
 
-  #ifdef SHELLY_SW1
-  volatile uint8_t sw1StateFrame[5];
-  volatile uint8_t sw1StateFrameDuration[5];
-  #endif
+  // The current state of the switches
+  volatile uint8_t swState[Board::NB_SWITCH_IDS];
 
-  #ifdef SHELLY_SW2
-  volatile uint8_t sw2StateFrame[5];
-  volatile uint8_t sw2StateFrameDuration[5];
-  #endif
-
-  // The current state of the switch
-  volatile uint8_t sw0State=ALREADY_PUBLISHED;
-  volatile uint8_t sw1State=ALREADY_PUBLISHED;
-  volatile uint8_t sw2State=ALREADY_PUBLISHED;
+  // Incremented for each new switch event, the MQTT state above is kept until it is published
+  volatile uint8_t swEventCount[Board::NB_SWITCH_IDS];
+  uint8_t swEventPosted[Board::NB_SWITCH_IDS];
 
   void enableBuiltinLedBlinking(uint8_t ledMode)
   {
@@ -97,12 +107,12 @@ namespace switches {
     ledBlinkTickCounter=0;
     ledBlinkingMode=ledMode;
     ledOnTime=0;
-    pinMode(SHELLY_BUILTIN_LED, OUTPUT);
+    pinMode(Board::BUILTIN_LED, OUTPUT);
     switch(ledMode)
     {
       case LED_OFF:
       ledBlinkDuration=0;         // No blinking
-      digitalWrite(SHELLY_BUILTIN_LED, HIGH);
+      digitalWrite(Board::BUILTIN_LED, HIGH);
       break;
       case LED_FAST_BLINKING:
       ledBlinkDuration=4;         // 100 ms
@@ -112,7 +122,7 @@ namespace switches {
       break;
       case LED_ON:
       ledBlinkDuration=0;         // No blinking
-      digitalWrite(SHELLY_BUILTIN_LED, LOW);
+      digitalWrite(Board::BUILTIN_LED, LOW);
       ledOnTime=millis();         // Save the time when the led is switched on
       break;
     }
@@ -120,18 +130,10 @@ namespace switches {
   
   volatile uint8_t &getSwState(uint8_t switchID)
   {
-    uint8_t temp;
-    switch(switchID)
-    {
-      case 0:
-      return sw0State;
-      case 1:
-      return sw1State;
-      case 2:
-      return sw2State;
-    }
+    if (switchID < Board::NB_SWITCH_IDS)
+      return swState[switchID];
     logging::getLogStream().printf("switches: wrong switchID for getSwState().\n");
-    return sw0State;
+    return swState[0];
   }
 
   volatile uint8_t ICACHE_RAM_ATTR processFrame(volatile uint8_t newState, volatile uint8_t *swStateFrame, volatile uint8_t *swStateFrameDuration)
@@ -163,22 +165,22 @@ namespace switches {
       // Toggle button
       if (swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
       {
-        light::lightOff();
+        light::lightOff(light::SOURCE_SWITCH);
         return BUTTON_OFF_ON_OFF;
       }
       else if (swStateFrame[3]==switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION && swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==1)
       {
-        light::lightOn();
+        light::lightOn(false, light::SOURCE_SWITCH);
         return BUTTON_ON_OFF_ON;
       }
       else if (swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==1)
       {
-        light::lightOn();
+        light::lightOn(false, light::SOURCE_SWITCH);
         return BUTTON_ON;
       }
       else if (swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
       {
-        light::lightOff();
+        light::lightOff(light::SOURCE_SWITCH);
         return BUTTON_OFF;
       }
     }
@@ -192,66 +194,77 @@ namespace switches {
           swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION &&
           swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
       {
-        light::lightToggle();
+        light::lightToggle(false, light::SOURCE_SWITCH);
         return BUTTON_DOUBLE_CLICK;
       }
       else if (swStateFrame[3]!=switchStateForLightOff && swStateFrameDuration[3]<LONG_CLICK_DURATION &&
                swStateFrame[4]==switchStateForLightOff && swStateFrameDuration[4]==1)
       {
         // short click
-        light::lightToggle();
+        light::lightToggle(false, light::SOURCE_SWITCH);
         return BUTTON_SHORT_CLICK;
       }
       else if (swStateFrame[3]==switchStateForLightOff && swStateFrame[4]!=switchStateForLightOff && swStateFrameDuration[4]==LONG_CLICK_DURATION)
       {
         // Long click with parameter true to disable the light auto turn off
-        light::lightToggle(true);
+        light::lightToggle(true, light::SOURCE_SWITCH);
         return BUTTON_LONG_CLICK;
       }
     }
     return NO_CHANGE;
   }
   
-  void ICACHE_RAM_ATTR checkSwitch(void)
+  // Duration of the interrupt above which it is recorded by the watchdog, in us
+  #define ISR_OVERRUN 2000
+
+  // The gestures of the built-in switch
+  void ICACHE_RAM_ATTR builtinSwitchEvent(uint8_t state)
   {
-    volatile uint8_t newState,tmp;
+    switch(state)
+    {
+      case BUTTON_SHORT_CLICK:
+      logging::getLogStream().println("switch: BUTTON_SHORT_CLICK for built-in switch");
+      break;
+      case BUTTON_DOUBLE_CLICK:
+      logging::getLogStream().println("switch: BUTTON_DOUBLE_CLICK for built-in switch");
+      break;
+      case BUTTON_LONG_CLICK:
+      logging::getLogStream().println("switch: BUTTON_LONG_CLICK for built-in switch");
+      wifi::factoryReset();
+      break;
+    }
+  }
 
-    #ifdef SHELLY_SW0
-    newState=digitalRead(SHELLY_SW0);
-    tmp=processFrame(newState, sw0StateFrame, sw0StateFrameDuration);
-    if (tmp!=NO_CHANGE)
+  // Read the switch ID and the following ones, unrolled at compile time for the wired switches
+  // Inlined in checkSwitch() so that it stays in IRAM
+  template <uint8_t ID> inline __attribute__((always_inline)) void checkSwitchID()
+  {
+    if constexpr (ID < Board::NB_SWITCH_IDS)
     {
-      sw0State=tmp;
-      switch(sw0State)
+      if constexpr (Board::SWITCH_PINS[ID] != NO_PIN)
       {
-        case BUTTON_SHORT_CLICK:
-        logging::getLogStream().println("switch: BUTTON_SHORT_CLICK for built-in switch");
-        break;
-        case BUTTON_DOUBLE_CLICK:
-        logging::getLogStream().println("switch: BUTTON_DOUBLE_CLICK for built-in switch");
-        break;
-        case BUTTON_LONG_CLICK:
-        logging::getLogStream().println("switch: BUTTON_LONG_CLICK for built-in switch");
-        wifi::factoryReset();
-        break;
+        uint8_t tmp=processFrame(digitalRead(Board::SWITCH_PINS[ID]), swStateFrame[ID], swStateFrameDuration[ID]);
+        if (tmp!=NO_CHANGE)
+        {
+          swState[ID]=tmp;
+          swEventCount[ID]++;
+          scheduler::wakeUp();
+          if constexpr (ID == 0)
+            builtinSwitchEvent(tmp);
+        }
       }
+      checkSwitchID<ID + 1>();
     }
-    #endif
-    
-    #ifdef SHELLY_SW1
-    newState=digitalRead(SHELLY_SW1);
-    tmp=processFrame(newState, sw1StateFrame, sw1StateFrameDuration);
-    if (tmp!=NO_CHANGE)
-      sw1State=tmp;
-    #endif
-
-    #ifdef SHELLY_SW2
-    newState=digitalRead(SHELLY_SW2);
-    //logging::getLogStream().printf("%d",newState);            // For debugging
-    tmp=processFrame(newState, sw2StateFrame, sw2StateFrameDuration); 
-    if (tmp!=NO_CHANGE)
-      sw2State=tmp;   
-    #endif
+  }
+
+  void ICACHE_RAM_ATTR checkSwitch(void)
+  {
+    uint32_t start = micros();
+
+    // The timer interrupt still runs when the loop is stalled
+    watchdog::checkStall();
+
+    checkSwitchID<0>();
 
     // For the built-in led blinking
     if (ledBlinkDuration>0)
@@ -259,51 +272,61 @@ namespace switches {
       ledBlinkTickCounter++;
       if (ledBlinkTickCounter>ledBlinkDuration)
       {
-        digitalWrite(SHELLY_BUILTIN_LED, !(digitalRead(SHELLY_BUILTIN_LED)));  //Invert Current State of LED
+        digitalWrite(Board::BUILTIN_LED, !(digitalRead(Board::BUILTIN_LED)));  //Invert Current State of LED
         ledBlinkTickCounter=0;
       }
     }
+
+    uint32_t duration = micros() - start;
+    if (duration > ISR_OVERRUN)
+      watchdog::breadcrumb(watchdog::CRUMB_ISR_OVERRUN, duration);
   }
   
-  void setup()
+  template <uint8_t ID> void setupSwitchID()
   {
-    uint8_t state;
-    
-    #ifdef SHELLY_SW0
-    pinMode(SHELLY_SW0, INPUT_PULLUP);  // only works with INPUT_PULLUP
-    state=digitalRead(SHELLY_SW0);
-    for (int i=0;i<sizeof(sw0StateFrame);i++)
-    {
-      sw0StateFrameDuration[i]=255;
-      sw0StateFrame[i]=state;
-    }
-    #endif
-
-    #ifdef SHELLY_SW1
-    pinMode(SHELLY_SW1, INPUT);
-    state=digitalRead(SHELLY_SW1);
-    // Initialise the frame with the current state of the switch
-    // By default, the light is off when the switch is powering on
-    for (int i=0;i<sizeof(sw1StateFrame);i++)
+    if constexpr (ID < Board::NB_SWITCH_IDS)
     {
-      sw1StateFrameDuration[i]=255;
-      sw1StateFrame[i]=state;
+      if constexpr (Board::SWITCH_PINS[ID] != NO_PIN)
+      {
+        // The built-in switch only works with INPUT_PULLUP
+        pinMode(Board::SWITCH_PINS[ID], ID == 0 ? INPUT_PULLUP : INPUT);
+        uint8_t state=digitalRead(Board::SWITCH_PINS[ID]);
+        // Initialise the frame with the current state of the switch
+        // By default, the light is off when the switch is powering on
+        for (int i=0;i<sizeof(swStateFrame[ID]);i++)
+        {
+          swStateFrameDuration[ID][i]=255;
+          swStateFrame[ID][i]=state;
+        }
+      }
+      setupSwitchID<ID + 1>();
     }
-    #endif
-    
-    #ifdef SHELLY_SW2
-    pinMode(SHELLY_SW2, INPUT);
-    state=digitalRead(SHELLY_SW2);
-    for (int i=0;i<sizeof(sw2StateFrame);i++)
+  }
+
+  void setup()
+  {
+    for (uint8_t id=0;id<Board::NB_SWITCH_IDS;id++)
     {
-      sw2StateFrameDuration[i]=255;
-      sw2StateFrame[i]=state;
+      swState[id]=ALREADY_PUBLISHED;
+      swEventCount[id]=0;
+      swEventPosted[id]=0;
     }
-    #endif
+    setupSwitchID<0>();
     
     // Interrup every 25 ms, misses click with 50 ms
     // Bug: interrup should be disable when firmware is uploading
     ITimer.attachInterruptInterval(1000 * INTERRUP_TIME, checkSwitch);
+
+    scheduler::addTask("switches", handleSwitches, scheduler::PRIORITY_HIGH, 0, 1000);
+    scheduler::addTask("temp", handleTemperature, scheduler::PRIORITY_NORMAL, 250, 2000);
+  }
+
+  // Wake up from the light sleep when the external switch changes
+  void enableWakeUp()
+  {
+    constexpr uint8_t pin = Board::SWITCH_PINS[Board::WAKEUP_SWITCH_ID];
+    if constexpr (pin != NO_PIN)
+      gpio_pin_wakeup_enable(GPIO_ID_PIN(pin), digitalRead(pin) ? GPIO_PIN_INTR_LOLEVEL : GPIO_PIN_INTR_HILEVEL);
   }
 
   // Disable timer interrupt. This is needed for the OTA firmware update since it can corrupt the uploading
@@ -353,15 +376,15 @@ namespace switches {
   {
     // Should not use analogread to often otherwise the wifi stops working
     // Range: 387 (cold) to 226 (hot)
-    int adc = analogRead(TEMPERATURE_SENSOR);
+    int adc = analogRead(Board::NTC_PIN);
     
-    // Shelly 2.5 NTC Thermistor
+    // NTC Thermistor of the board traits
     // 3V3 --- ANALOG_NTC_BRIDGE_RESISTANCE ---v--- NTC --- Gnd
     //                                         |
     //                                        ADC0
-    #define ANALOG_NTC_BRIDGE_RESISTANCE  32000            // NTC Voltage bridge resistor
-    #define ANALOG_NTC_RESISTANCE         10000            // NTC Resistance
-    #define ANALOG_NTC_B_COEFFICIENT      3350             // NTC Beta Coefficient
+    #define ANALOG_NTC_BRIDGE_RESISTANCE  Board::NTC_BRIDGE_RESISTANCE  // NTC Voltage bridge resistor
+    #define ANALOG_NTC_RESISTANCE         Board::NTC_RESISTANCE         // NTC Resistance
+    #define ANALOG_NTC_B_COEFFICIENT      Board::NTC_B_COEFFICIENT      // NTC Beta Coefficient
     // Parameters for equation
     #define TO_CELSIUS(x) ((x) - 273.15)
     #define TO_KELVIN(x) ((x) + 273.15)
@@ -384,6 +407,30 @@ namespace switches {
     setDefaultSwitchReleaseState(wifi::getParamValueFromID("defaultReleaseState"));
   }
 
+  // Publish again the overheating alarm if it is still active
+  void republishState()
+  {
+    mqttOverheatingAlarm=false;
+  }
+
+  // Send the switch events to the /events clients and the rules, even when MQTT is not connected
+  void postSwitchEvent(uint8_t switchID)
+  {
+    uint8_t count=swEventCount[switchID];
+    if (count==swEventPosted[switchID])
+      return;
+    swEventPosted[switchID]=count;
+    uint8_t state=getSwState(switchID);
+    if (state==ALREADY_PUBLISHED)
+      return;
+    char data[72];
+    char stateStr[BUTTON_STATE_STR_SIZE];
+    snprintf(data, sizeof(data), "{\"switch\":%d,\"event\":\"%s\",\"light\":\"%s\"}", switchID, getButtonStateStr(state, stateStr),
+             light::lightIsOn() ? "ON" : "OFF");
+    events::post("switch", data);
+    rules::onGesture(switchID, state);
+  }
+
   void publishMQTTChangeSwitch(uint8_t switchID)
   {
     if (getSwState(switchID)!=ALREADY_PUBLISHED)
@@ -393,29 +440,49 @@ namespace switches {
       if (topic!=NULL)
       {
         char payload[50];
+        char stateStr[BUTTON_STATE_STR_SIZE];
+        getButtonStateStr(getSwState(switchID), stateStr);
         if (light::lightIsOn())
-          sprintf(payload,"%s LIGHT_ON %d",BUTTON_STATE_STR[getSwState(switchID)], switchID);
+          snprintf(payload, sizeof(payload), "%s LIGHT_ON %d", stateStr, switchID);
         else
-          sprintf(payload,"%s LIGHT_OFF %d",BUTTON_STATE_STR[getSwState(switchID)], switchID);
+          snprintf(payload, sizeof(payload), "%s LIGHT_OFF %d", stateStr, switchID);
         if (mqtt::publishMQTT(topic,payload))
           getSwState(switchID)=ALREADY_PUBLISHED;
       }
     }
   }
   
-  void handle()
+  template <uint8_t ID> void handleSwitchID()
+  {
+    if constexpr (ID < Board::NB_SWITCH_IDS)
+    {
+      if constexpr (Board::SWITCH_PINS[ID] != NO_PIN)
+      {
+        postSwitchEvent(ID);
+        publishMQTTChangeSwitch(ID);
+      }
+      handleSwitchID<ID + 1>();
+    }
+  }
+
+  // The switch events, run with a high priority
+  void handleSwitches()
   { 
     // Publish new values to MQTT if needed
-    #ifdef SHELLY_SW0
-    publishMQTTChangeSwitch(0);
-    #endif
-    #ifdef SHELLY_SW1
-    publishMQTTChangeSwitch(1);
-    #endif
-    #ifdef SHELLY_SW2
-    publishMQTTChangeSwitch(2);
-    #endif
-    
+    handleSwitchID<0>();
+
+    // Switch off the builtin led if its mode is on after one minute
+    if ((ledOnTime!=0) && (ledBlinkingMode==LED_ON) && (millis()-ledOnTime>60000))
+    {
+      // Switch of the builtin led after one minute
+      ledOnTime=0;
+      digitalWrite(Board::BUILTIN_LED, HIGH);
+    }
+  }
+
+  // The temperature and the overheating alarm
+  void handleTemperature()
+  {
     // Check the internal temperature every 1 second
     unsigned long now=millis();
     if(now - prevTime > 1000)
@@ -430,6 +497,26 @@ namespace switches {
           overheating(temperature);
         else if (temperature<75.0)    // To avoid sending multiple messages
           overheatingAlarm=false;
+
+        rules::onTemperature(temperature);
+
+        char data[48];
+        int16_t tenths=(int16_t)(temperature*10);
+        // Only the changes of at least 0.5°C are sent
+        if (abs(tenths-postedTemperature)>=5)
+        {
+          postedTemperature=tenths;
+          sprintf(data,"{\"temperature\":%.1f}", temperature);
+          events::post("temperature", data);
+        }
+        if (overheatingAlarm!=postedOverheatingAlarm)
+        {
+          postedOverheatingAlarm=overheatingAlarm;
+          sprintf(data,"{\"overheat\":%s,\"temperature\":%.1f}", overheatingAlarm ? "true" : "false", temperature);
+          events::post("alarm", data);
+          if (overheatingAlarm)
+            rules::onOverheat();
+        }
     }
 
     // Publish MQTT overheating alarm
@@ -441,26 +528,30 @@ namespace switches {
       if (topic!=NULL)
       {
         const char* hn = wifi::getParamValueFromID("hostname");
-        char payload[8];
+        // The hostname has at most 30 characters
+        char payload[56];
         if (hn!=NULL)
-          sprintf(payload, "\"%s\" %f", hn, temperature);
+          snprintf(payload, sizeof(payload), "\"%s\" %.1f", hn, temperature);
         else
-          sprintf(payload, "%f", temperature);        
+          snprintf(payload, sizeof(payload), "%.1f", temperature);
         if (mqtt::publishMQTT(topic, payload))
+        {
           mqttOverheatingAlarm=true;
+          mqtt::publishStatus();
+        }
       }
     }
     if (overheatingAlarm==false && mqttOverheatingAlarm==true)
     {
       mqttOverheatingAlarm=false;
+      mqtt::publishStatus();
     }
-    // Switch off the builtin led if its mode is on after one minute
-    if ((ledOnTime!=0) && (ledBlinkingMode==LED_ON) && (now-ledOnTime>60000))
-    {
-      // Switch of the builtin led after one minute
-      ledOnTime=0;
-      digitalWrite(SHELLY_BUILTIN_LED, HIGH);
-    }
+  }
+
+  void handle()
+  {
+    handleSwitches();
+    handleTemperature();
   }
 
   void setSwitchType(const char* str)
@@ -11,20 +11,39 @@ namespace switches {
 
   enum { LED_UNKNOWN, LED_OFF, LED_FAST_BLINKING, LED_SLOW_BLINKING, LED_ON };
 
+  // The possible states for the switches for TOGGLE_BUTTON
+  #define BUTTON_OFF                  0
+  #define BUTTON_ON                   1
+  #define BUTTON_OFF_ON_OFF           2
+  #define BUTTON_ON_OFF_ON            3
+  // The possible states for the switches for PUSH_BUTTON
+  #define BUTTON_SHORT_CLICK          4
+  #define BUTTON_LONG_CLICK           5
+  #define BUTTON_DOUBLE_CLICK         6
+
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
   // For the built-in led blinking
   void enableBuiltinLedBlinking(uint8_t ledMode);
   
   // Getter
   float &getTemperature();
   bool &getTemperatureLogging();
+  bool &getOverheatingAlarm();
   
   void setSwitchType(const char* str);
   void setDefaultSwitchReleaseState(const char* str);
   
+  void republishState();
+
   float readTemperature();
   void updateParams();
   void setup();
   void disableInterrupt();
+  void enableWakeUp();
+  void handleSwitches();
+  void handleTemperature();
   void handle();
 }
 
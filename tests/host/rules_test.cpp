@@ -0,0 +1,389 @@
+// Host test of the rules compiler, the bytecode verifier and the interpreter
+// Build and run: make -C tests/host
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "../../config.cpp"
+#include "../../rules.cpp"
+
+unsigned long hostMillis = 0;
+HostFS LittleFS;
+
+// The actions of the rules are recorded here, without allocation
+char actions[256];
+const char* rulesParam = NULL;
+bool lightState = false;
+float temperature = 40.0;
+
+// Linked with --wrap (see the Makefile) like the firmware with ALLOCATION_COUNTER
+uint32_t allocations = 0;
+
+extern "C"
+{
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+  void* __real__Znwm(size_t size);
+  void* __real__Znam(size_t size);
+
+  void* __wrap_malloc(size_t size) { allocations++; return __real_malloc(size); }
+  void* __wrap_calloc(size_t count, size_t size) { allocations++; return __real_calloc(count, size); }
+  void* __wrap_realloc(void* ptr, size_t size) { allocations++; return __real_realloc(ptr, size); }
+  void* __wrap__Znwm(size_t size) { allocations++; return __real__Znwm(size); }
+  void* __wrap__Znam(size_t size) { allocations++; return __real__Znam(size); }
+}
+
+void record(const char* format, ...)
+{
+  size_t length = strlen(actions);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(actions + length, sizeof(actions) - length, format, args);
+  va_end(args);
+}
+
+bool actionsAre(const char* expected)
+{
+  bool ok = strcmp(actions, expected) == 0;
+  if (!ok)
+    printf("actions: \"%s\", expected \"%s\"\n", actions, expected);
+  actions[0] = 0x00;
+  return ok;
+}
+
+namespace logging
+{
+  LogStream::LogStream() {}
+  void LogStream::setLogOutput(const char*) {}
+  size_t LogStream::write(uint8_t) { return 1; }
+  size_t LogStream::write(const uint8_t*, size_t size) { return size; }
+  int LogStream::availableForWrite() { return 256; }
+  int LogStream::available() { return 0; }
+  int LogStream::read() { return -1; }
+  int LogStream::peek() { return -1; }
+  void LogStream::flush() {}
+  LogStream &getLogStream()
+  {
+    static LogStream stream;
+    return stream;
+  }
+}
+
+namespace wifi
+{
+  const char* getParamValueFromID(const char*) { return rulesParam; }
+  void requestPortal() { record("PORTAL;"); }
+}
+
+namespace light
+{
+  void lightOn(bool, uint8_t) { record("ON;"); lightState = true; }
+  void lightOff(uint8_t) { record("OFF;"); lightState = false; }
+  void lightToggle(bool, uint8_t) { record("TOGGLE;"); lightState = !lightState; }
+  bool lightIsOn() { return lightState; }
+  void setBlinkingDuration(const char* str) { record("DURATION %s;", str); }
+  void startBlinking() { record("BLINK;"); }
+}
+
+namespace mqtt
+{
+  // The buffer of PubSubClient holds the received topic and is reused to send a message
+  char clientBuffer[128];
+  bool publishMQTT(const char* topic, const char* payload, bool)
+  {
+    record("PUBLISH %s %s;", topic, payload);
+    snprintf(clientBuffer, sizeof(clientBuffer), "%s", topic);
+    return true;
+  }
+  void updateSubscriptions() { record("SUBSCRIBE;"); }
+}
+
+namespace switches
+{
+  float &getTemperature() { return temperature; }
+}
+
+namespace scheduler
+{
+  bool addTask(const char*, void (*)(), uint8_t, uint16_t, uint16_t, uint32_t (*)()) { return true; }
+}
+
+int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+bool compiles(const char* str)
+{
+  return rules::compile(str);
+}
+
+bool bytecodeIs(const char* str, const uint8_t* expected, uint16_t length)
+{
+  if (!rules::compile(str))
+    return false;
+  return rules::compiledLength == length && memcmp(rules::compiled, expected, length) == 0;
+}
+
+// Load the rules as when the parameter is saved, the program file is written again
+void loadRules(const char* str)
+{
+  LittleFS.remove("/rules.bin");
+  rulesParam = str;
+  rules::programLoaded = false;
+  rules::updateParams();
+  actions[0] = 0x00;
+}
+
+void testTriggers()
+{
+  const uint8_t sw[] = {5, rules::T_SWITCH, 1, BUTTON_DOUBLE_CLICK, rules::A_ON};
+  CHECK(bytecodeIs("switch 1 double then on", sw, 5));
+  const uint8_t above[] = {5, rules::T_TEMP_ABOVE, 0xF4, 0x01, rules::A_OFF};
+  CHECK(bytecodeIs("temp above 50 then off", above, 5));
+  const uint8_t below[] = {5, rules::T_TEMP_BELOW, 0x95, 0x01, rules::A_TOGGLE};
+  CHECK(bytecodeIs("temp below 40.5 then toggle", below, 5));
+  const uint8_t overheat[] = {3, rules::T_OVERHEAT, rules::A_PORTAL};
+  CHECK(bytecodeIs("overheat then portal", overheat, 3));
+  const uint8_t every[] = {5, rules::T_EVERY, 0x10, 0x0E, rules::A_ON};
+  CHECK(bytecodeIs("every 3600 then on", every, 5));
+  const uint8_t mqttAny[] = {8, rules::T_MQTT, 1, 't', 0, 0, 0, rules::A_ON};
+  CHECK(bytecodeIs("mqtt t then on", mqttAny, 8));
+  const uint8_t mqttPayload[] = {9, rules::T_MQTT, 1, 't', 0, 1, 'x', 0, rules::A_ON};
+  CHECK(bytecodeIs("mqtt t x then on", mqttPayload, 9));
+  for (uint8_t state = 0; rules::GESTURE_NAMES[state] != NULL; state++)
+  {
+    char str[48];
+    snprintf(str, sizeof(str), "switch 2 %s then on", rules::GESTURE_NAMES[state]);
+    CHECK(compiles(str) && rules::compiled[3] == state);
+  }
+
+  CHECK(!compiles("switch 3 click then on"));
+  CHECK(!compiles("switch 1 triple then on"));
+  CHECK(!compiles("temp around 50 then on"));
+  CHECK(!compiles("temp above hot then on"));
+  CHECK(!compiles("every 0 then on"));
+  CHECK(!compiles("mqtt then on"));
+  CHECK(!compiles("sunset then on"));
+}
+
+void testConditions()
+{
+  const uint8_t lightOn[] = {4, rules::T_OVERHEAT, rules::C_LIGHT_ON, rules::A_OFF};
+  CHECK(bytecodeIs("overheat if light on then off", lightOn, 4));
+  CHECK(compiles("overheat if light off and temp below 80 and temp above 10 then on"));
+  CHECK(rules::compiled[2] == rules::C_LIGHT_OFF && rules::compiled[3] == rules::C_TEMP_BELOW &&
+        rules::compiled[6] == rules::C_TEMP_ABOVE && rules::compiled[9] == rules::A_ON);
+
+  CHECK(!compiles("overheat if light dim then on"));
+  CHECK(!compiles("overheat if door open then on"));
+  CHECK(!compiles("overheat if light on on"));
+}
+
+void testActions()
+{
+  const uint8_t blink[] = {10, rules::T_OVERHEAT, rules::A_BLINK, 30, 0, rules::A_BLINK, 0, 0, rules::A_ON, rules::A_PORTAL};
+  CHECK(bytecodeIs("overheat then blink 30, blink, on, portal", blink, 10));
+  const uint8_t publish[] = {10, rules::T_OVERHEAT, rules::A_PUBLISH, 1, 'a', 0, 2, 'o', 'n', 0};
+  CHECK(bytecodeIs("overheat then publish a on", publish, 10));
+
+  CHECK(!compiles("overheat then dance"));
+  CHECK(!compiles("overheat then publish"));
+  CHECK(!compiles("overheat then publish topic"));
+  CHECK(!compiles("overheat then blink 70000"));
+  CHECK(!compiles("overheat on"));
+  CHECK(!compiles("overheat then on off"));
+
+  // Several rules and empty ones
+  CHECK(compiles(";switch 1 click then on;; overheat then off;") && rules::compiledRules == 2);
+  CHECK(compiles(""));
+  CHECK(rules::compiledRules == 0);
+}
+
+bool verifies(const uint8_t* code, uint16_t length, uint8_t count)
+{
+  return rules::verify(code, length, count);
+}
+
+void testVerify()
+{
+  CHECK(compiles("switch 1 click if light on then publish topic payload, off; mqtt a b then blink 5"));
+  uint8_t code[MAX_PROGRAM_SIZE];
+  uint16_t length = rules::compiledLength;
+  memcpy(code, rules::compiled, length);
+  CHECK(verifies(code, length, 2));
+
+  // Truncated at every length
+  for (uint16_t l = 0; l < length; l++)
+    CHECK(!verifies(code, l, 2));
+  // Wrong number of rules
+  CHECK(!verifies(code, length, 1));
+  CHECK(!verifies(code, length, 3));
+  // Trailing bytes
+  uint8_t longer[MAX_PROGRAM_SIZE];
+  memcpy(longer, code, length);
+  longer[length] = rules::A_ON;
+  CHECK(!verifies(longer, length + 1, 2));
+
+  uint8_t bad[MAX_PROGRAM_SIZE];
+  // Rule length too short or beyond the program
+  memcpy(bad, code, length);
+  bad[0] = 2;
+  CHECK(!verifies(bad, length, 2));
+  memcpy(bad, code, length);
+  bad[0] = 255;
+  CHECK(!verifies(bad, length, 2));
+  // The first instruction is not a trigger
+  memcpy(bad, code, length);
+  bad[1] = rules::A_ON;
+  CHECK(!verifies(bad, length, 2));
+  // Unknown opcode
+  memcpy(bad, code, length);
+  bad[4] = 0x7F;
+  CHECK(!verifies(bad, length, 2));
+  // String without its final 0x00, or longer than the rule
+  memcpy(bad, code, length);
+  uint8_t topic = 5;              // Length of "topic", after the trigger, the condition and A_PUBLISH
+  CHECK(bad[6] == topic);
+  bad[6 + topic + 1] = 'x';
+  CHECK(!verifies(bad, length, 2));
+  memcpy(bad, code, length);
+  bad[6] = 200;
+  CHECK(!verifies(bad, length, 2));
+  // A trigger after the first instruction, or a condition after an action
+  const uint8_t secondTrigger[] = {7, rules::T_OVERHEAT, rules::A_ON, rules::T_SWITCH, 0x24, 0x05, rules::A_OFF};
+  CHECK(!verifies(secondTrigger, 7, 1));
+  // The interpreter stops there instead of reading the operands as actions
+  rules::executeRule(secondTrigger + 2, secondTrigger + 7);
+  CHECK(actionsAre("ON;"));
+  const uint8_t lateCondition[] = {4, rules::T_OVERHEAT, rules::A_ON, rules::C_LIGHT_ON};
+  CHECK(!verifies(lateCondition, 4, 1));
+  const uint8_t ordered[] = {5, rules::T_OVERHEAT, rules::C_LIGHT_ON, rules::C_LIGHT_OFF, rules::A_ON};
+  CHECK(verifies(ordered, 5, 1));
+  // An operand cut by the end of the rule
+  const uint8_t cut[] = {3, rules::T_EVERY, 0x10};
+  CHECK(!verifies(cut, 3, 1));
+
+  // A corrupted file is compiled again from the parameter
+  loadRules("overheat then on");
+  LittleFS.content[RULES_HEADER_SIZE + 1] = 0x7F;
+  rules::programLoaded = false;
+  rules::nbRules = 0;
+  rules::updateParams();
+  CHECK(rules::nbRules == 1 && rules::program[1] == rules::T_OVERHEAT);
+}
+
+void testRun()
+{
+  loadRules("switch 1 double then on; switch 1 long if light on then off, publish t long;"
+            "temp above 50 then blink 30; temp below 40 then toggle; overheat if temp above 70 then portal;"
+            "every 10 if light on then off; mqtt cmd then on; mqtt cmd stop then off");
+  CHECK(rules::nbRules == 8);
+  // The events are processed without any allocation, as in the steady state of the firmware
+  uint32_t bootAllocations = allocations;
+
+  rules::onGesture(1, BUTTON_DOUBLE_CLICK);
+  CHECK(actionsAre("ON;"));
+  rules::onGesture(2, BUTTON_DOUBLE_CLICK);
+  rules::onGesture(1, BUTTON_SHORT_CLICK);
+  CHECK(actionsAre(""));
+
+  lightState = true;
+  rules::onGesture(1, BUTTON_LONG_CLICK);
+  CHECK(actionsAre("OFF;PUBLISH t long;"));
+  rules::onGesture(1, BUTTON_LONG_CLICK);
+  CHECK(actionsAre(""));
+
+  // Only when the thresholds are crossed
+  rules::onTemperature(45.0);
+  rules::onTemperature(49.0);
+  CHECK(actionsAre(""));
+  rules::onTemperature(51.0);
+  CHECK(actionsAre("DURATION 30;BLINK;"));
+  rules::onTemperature(52.0);
+  CHECK(actionsAre(""));
+  rules::onTemperature(39.5);
+  CHECK(actionsAre("TOGGLE;"));
+
+  temperature = 60.0;
+  rules::onOverheat();
+  CHECK(actionsAre(""));
+  temperature = 85.0;
+  rules::onOverheat();
+  CHECK(actionsAre("PORTAL;"));
+
+  // The timer fires once per period, when its condition is true
+  lightState = true;
+  hostMillis += 5000;
+  rules::handle();
+  CHECK(actionsAre(""));
+  hostMillis += 5000;
+  rules::handle();
+  CHECK(actionsAre("OFF;"));
+  hostMillis += 10000;
+  rules::handle();
+  CHECK(actionsAre(""));
+
+  CHECK(rules::onMqttMessage("cmd", "go"));
+  CHECK(actionsAre("ON;"));
+  CHECK(rules::onMqttMessage("cmd", "stop"));
+  CHECK(actionsAre("ON;OFF;"));
+  CHECK(!rules::onMqttMessage("other", "stop"));
+  CHECK(actionsAre(""));
+
+  CHECK(rules::getNbMqttTopics() == 2);
+  CHECK(strcmp(rules::getMqttTopic(0), "cmd") == 0 && rules::getMqttTopic(2) == NULL);
+
+  CHECK(allocations == bootAllocations);
+
+  // A rule with an error keeps the previous program
+  rulesParam = "overheat then dance";
+  rules::updateParams();
+  CHECK(rules::nbRules == 8);
+}
+
+// The topic given by the MQTT client is overwritten when the first rule publishes
+void testMqttTopicReused()
+{
+  loadRules("mqtt in then publish out x; mqtt in then on");
+  strcpy(mqtt::clientBuffer, "in");
+  lightState = false;
+  CHECK(rules::onMqttMessage(mqtt::clientBuffer, "go"));
+  CHECK(actionsAre("PUBLISH out x;ON;"));
+  // No rule has a topic longer than a token
+  char longTopic[MAX_TOKEN_LENGTH + 1];
+  memset(longTopic, 'a', MAX_TOKEN_LENGTH);
+  longTopic[MAX_TOKEN_LENGTH] = 0;
+  CHECK(!rules::onMqttMessage(longTopic, "go"));
+}
+
+// The counter sees the allocations of the test itself, so a zero count means something
+void testAllocationCounter()
+{
+  uint32_t before = allocations;
+  char* buffer = (char*)malloc(32);
+  uint8_t* array = new uint8_t[32];
+  CHECK(allocations == before + 2);
+  delete[] array;
+  free(buffer);
+}
+
+int main()
+{
+  testAllocationCounter();
+  testTriggers();
+  testConditions();
+  testActions();
+  testVerify();
+  testRun();
+  testMqttTopicReused();
+  if (failures > 0)
+  {
+    printf("rules_test: %d failures\n", failures);
+    return 1;
+  }
+  printf("rules_test: OK\n");
+  return 0;
+}
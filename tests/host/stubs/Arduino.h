@@ -0,0 +1,64 @@
+// Minimal Arduino API for building the firmware modules on the host
+#ifndef HOST_ARDUINO
+#define HOST_ARDUINO
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <memory>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define ICACHE_RAM_ATTR
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define A0 17
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// Set by the tests
+extern unsigned long hostMillis;
+inline unsigned long millis() { return hostMillis; }
+inline unsigned long micros() { return hostMillis * 1000; }
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+      for (size_t i = 0; i < size; i++)
+        write(buffer[i]);
+      return size;
+    }
+    size_t print(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+    size_t println(const char* str) { return print(str) + print("\n"); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+      char buffer[256];
+      va_list args;
+      va_start(args, format);
+      vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+      return print(buffer);
+    }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif
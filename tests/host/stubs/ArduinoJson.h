@@ -0,0 +1,3 @@
+#ifndef HOST_ARDUINOJSON
+#define HOST_ARDUINOJSON
+#endif
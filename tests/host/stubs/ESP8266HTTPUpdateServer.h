@@ -0,0 +1,3 @@
+#ifndef HOST_ESP8266HTTPUPDATESERVER
+#define HOST_ESP8266HTTPUPDATESERVER
+#endif
@@ -0,0 +1,4 @@
+#ifndef HOST_ESP8266WIFI
+#define HOST_ESP8266WIFI
+#include <Arduino.h>
+#endif
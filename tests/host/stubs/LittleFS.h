@@ -0,0 +1,63 @@
+// A file system of one file kept in memory, enough for the modules storing a compiled file
+#ifndef HOST_LITTLEFS
+#define HOST_LITTLEFS
+#include <Arduino.h>
+#include <string>
+
+class File
+{
+  public:
+    File(std::string* content=NULL, bool writing=false) : content(content), pos(0)
+    {
+      if (content != NULL && writing)
+        content->clear();
+    }
+    operator bool() const { return content != NULL; }
+    int read(uint8_t* buffer, size_t size)
+    {
+      size_t n = content->size() - pos < size ? content->size() - pos : size;
+      memcpy(buffer, content->data() + pos, n);
+      pos += n;
+      return n;
+    }
+    size_t write(const uint8_t* buffer, size_t size)
+    {
+      content->append((const char*)buffer, size);
+      return size;
+    }
+    void close() {}
+  private:
+    std::string* content;
+    size_t pos;
+};
+
+class HostFS
+{
+  public:
+    File open(const char* path, const char* mode)
+    {
+      if (mode[0] == 'w')
+      {
+        name = path;
+        exists = true;
+        return File(&content, true);
+      }
+      if (!exists || name != path)
+        return File();
+      return File(&content);
+    }
+    bool remove(const char* path)
+    {
+      if (!exists || name != path)
+        return false;
+      exists = false;
+      return true;
+    }
+    std::string name;
+    std::string content;
+    bool exists = false;
+};
+
+extern HostFS LittleFS;
+
+#endif
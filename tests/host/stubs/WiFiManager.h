@@ -0,0 +1,13 @@
+#ifndef HOST_WIFIMANAGER
+#define HOST_WIFIMANAGER
+#include <Arduino.h>
+
+class ESP8266WebServer {};
+
+class WiFiManager
+{
+  public:
+    std::unique_ptr<ESP8266WebServer> server;
+};
+
+#endif
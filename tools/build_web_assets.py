@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""
+  Build web_assets.h from the files of the web folder.
+
+  Usage: build_web_assets.py [web folder] [output header]
+  By default, web/ and web_assets.h at the root of the repository.
+
+  Each asset is minified, gzipped and written as a PROGMEM byte array, with a strong ETag computed from the
+  compressed content. The header is generated again after any change of the web folder and committed, since
+  the Arduino IDE has no pre-build step.
+"""
+
+import gzip
+import hashlib
+import os
+import re
+import sys
+
+# The assets and the URL they are served at
+ASSETS = [
+    ("upload.html", "/config_upload", "text/html"),
+]
+
+
+def minify(text, name):
+    if name.endswith(".html"):
+        text = re.sub(r"<!--.*?-->", "", text, flags=re.S)
+        text = re.sub(r">\s+<", "><", text)
+    elif name.endswith(".css"):
+        text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+        text = re.sub(r"\s*([{};:,])\s*", r"\1", text)
+    return re.sub(r"\s+", " ", text).strip()
+
+
+def identifier(name):
+    return re.sub(r"[^A-Za-z0-9]", "_", name).upper() + "_GZ"
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    webDir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(root, "web")
+    output = sys.argv[2] if len(sys.argv) > 2 else os.path.join(root, "web_assets.h")
+
+    lines = ["// Generated by tools/build_web_assets.py from the web folder, do not edit",
+             "#ifndef WEB_ASSETS", "#define WEB_ASSETS", "", "#include <Arduino.h>", "",
+             "namespace webAssets", "{", "  struct Asset", "  {",
+             "    const char* uri;", "    const char* contentType;", "    const uint8_t* data;       // gzip, in flash",
+             "    uint16_t length;", "    const char* etag;", "  };", ""]
+    entries = []
+    for name, uri, contentType in ASSETS:
+        with open(os.path.join(webDir, name), encoding="utf-8") as f:
+            source = f.read()
+        # mtime=0 so that the same content gives the same bytes and the same ETag
+        data = gzip.compress(minify(source, name).encode("utf-8"), compresslevel=9, mtime=0)
+        etag = hashlib.sha1(data).hexdigest()[:16]
+        var = identifier(name)
+        lines.append("  // %s: %d bytes, %d bytes gzipped" % (name, len(source.encode("utf-8")), len(data)))
+        lines.append("  const uint8_t %s[] PROGMEM = {" % var)
+        for i in range(0, len(data), 16):
+            lines.append("    " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+        lines.append("  };")
+        lines.append("")
+        entries.append('    {"%s", "%s", %s, sizeof(%s), "\\"%s\\""},' % (uri, contentType, var, var, etag))
+        print("%s: %d -> %d bytes, ETag %s" % (name, len(source.encode("utf-8")), len(data), etag))
+
+    lines.append("  const Asset ASSETS[] =")
+    lines.append("  {")
+    lines.extend(entries)
+    lines.append("  };")
+    lines.append("  const uint8_t NB_ASSETS = sizeof(ASSETS) / sizeof(Asset);")
+    lines.append("}")
+    lines.append("")
+    lines.append("#endif")
+    with open(output, "w", newline="\n") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
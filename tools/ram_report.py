@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""
+  RAM report of the firmware, from the map file written by the linker.
+
+  The Arduino IDE keeps the map file in the build folder when "Show verbose output during compilation" is set,
+  or it can be requested with -Wl,-Map=shelly1PM.map.
+  Usage: ram_report.py [--budget bytes] [--top n] <shelly1PM.map>
+
+  The static RAM (.data, .rodata and .bss in the DRAM of the ESP8266) is summed for each object file.
+  The exit code is 1 when the total is above the budget, so that a regression stops the build script.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+# DRAM of the ESP8266, the IRAM and the flash are not counted
+DRAM_START = 0x3FFE8000
+DRAM_END = 0x40000000
+
+# Input section, e.g. " .bss.buffer  0x3ffef1a0  0x3e8 /tmp/arduino_build/sketch/config.cpp.o"
+# The name of a long section is alone on its line, the address and the size are on the next one
+SECTION_RE = re.compile(r"^ (\.\S+|COMMON)(?:\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S.*))?$")
+CONTINUATION_RE = re.compile(r"^\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S.*)$")
+
+
+def parse(path):
+    sizes = {}
+    pending = None
+    in_map = False
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("Linker script and memory map"):
+                in_map = True
+                continue
+            if not in_map:
+                continue
+            if pending is not None:
+                m = CONTINUATION_RE.match(line)
+                pending = None
+                if m:
+                    add(sizes, m.group(1), m.group(2), m.group(3))
+                continue
+            m = SECTION_RE.match(line)
+            if not m:
+                continue
+            if m.group(2) is None:
+                pending = m.group(1)
+            else:
+                add(sizes, m.group(2), m.group(3), m.group(4))
+    return sizes
+
+
+def add(sizes, address, size, obj):
+    address = int(address, 16)
+    size = int(size, 16)
+    if size == 0 or not (DRAM_START <= address < DRAM_END):
+        return
+    # The objects of the libraries are given as lib.a(obj.o)
+    name = os.path.basename(obj.strip())
+    sizes[name] = sizes.get(name, 0) + size
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Static RAM used by each object file")
+    parser.add_argument("map", help="map file written by the linker")
+    parser.add_argument("--budget", type=int, default=0, help="maximum static RAM in bytes (0: no check)")
+    parser.add_argument("--top", type=int, default=20, help="number of object files listed")
+    args = parser.parse_args()
+
+    sizes = parse(args.map)
+    total = sum(sizes.values())
+    for name, size in sorted(sizes.items(), key=lambda item: item[1], reverse=True)[:args.top]:
+        print("%7d  %s" % (size, name))
+    print("%7d  total static RAM" % total)
+
+    if args.budget > 0 and total > args.budget:
+        print("static RAM %d bytes is above the budget of %d bytes" % (total, args.budget), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,247 @@
+/*
+  Client for the UDP control of the Shelly, measuring the round-trip time of the commands.
+
+  Build: cc -O2 -o shelly_udp shelly_udp.c
+  Usage: shelly_udp -k <32 hex key> [-p port] [-n count] [-i interval_ms] [-a arg] [-d delay_ms] [-s seq] <host> <on|off|toggle|blink|query>
+
+  The host can be a multicast group: the datagram is then sent several times and no reply is expected.
+
+  Without -s, the first command is sent with the sequence number 0. The device rejects it with the status
+  BAD_SEQUENCE and gives the highest sequence number it has accepted, the command is then sent again after it.
+  The members of a group do not reply, so -s is required with a sequence number above the highest one of
+  each member and within 1024 of it (see the last line of a query to each member).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PACKET_SIZE 24
+#define TAG_OFFSET  16
+#define RETRIES     3
+#define TIMEOUT_MS  200
+#define STATUS_BAD_SEQUENCE 4
+
+static uint64_t readLE64(const uint8_t *p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                \
+  do {                                                          \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                    \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                    \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+  } while (0)
+
+// SipHash-2-4 of a message with a length multiple of 8 bytes, as in the firmware
+static uint64_t sipHash(const uint8_t *key, const uint8_t *msg, uint8_t len)
+{
+  uint64_t k0 = readLE64(key), k1 = readLE64(key + 8);
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+  for (uint8_t i = 0; i < len; i += 8)
+  {
+    uint64_t m = readLE64(msg + i);
+    v3 ^= m; SIPROUND; SIPROUND; v0 ^= m;
+  }
+  uint64_t b = ((uint64_t)len) << 56;
+  v3 ^= b; SIPROUND; SIPROUND; v0 ^= b;
+  v2 ^= 0xff; SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t readLE32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void sign(const uint8_t *key, uint8_t *packet)
+{
+  uint64_t tag = sipHash(key, packet, TAG_OFFSET);
+  for (int i = 0; i < 8; i++)
+    packet[TAG_OFFSET + i] = (uint8_t)(tag >> (8 * i));
+}
+
+static double nowUs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+  double d = *(const double *)a - *(const double *)b;
+  return (d > 0) - (d < 0);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s -k <32 hex key> [-p port] [-n count] [-i interval_ms] [-a arg] [-d delay_ms] [-s seq] <host> <on|off|toggle|blink|query>\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *keyStr = NULL, *port = "4210";
+  int count = 1, intervalMs = 100, opt;
+  unsigned arg = 0, delay = 0;
+  uint32_t seq = 0;
+  int seqGiven = 0;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "k:p:n:i:a:d:s:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'k': keyStr = optarg; break;
+      case 'p': port = optarg; break;
+      case 'n': count = atoi(optarg); break;
+      case 'i': intervalMs = atoi(optarg); break;
+      case 'a': arg = (unsigned)atoi(optarg); break;
+      case 'd': delay = (unsigned)atoi(optarg); break;
+      case 's':
+        seq = (uint32_t)strtoul(optarg, &end, 0);
+        if (optarg[0] == '-' || *end != 0)
+          usage(argv[0]);
+        seqGiven = 1;
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  if (keyStr == NULL || strlen(keyStr) != 32 || optind + 2 != argc || count < 1)
+    usage(argv[0]);
+
+  uint8_t key[16];
+  for (int i = 0; i < 16; i++)
+  {
+    char hex[3] = {keyStr[2 * i], keyStr[2 * i + 1], 0};
+    char *end;
+    key[i] = (uint8_t)strtoul(hex, &end, 16);
+    if (*end != 0)
+      usage(argv[0]);
+  }
+
+  const char *commands[] = {"on", "off", "toggle", "blink", "query"};
+  uint8_t cmd = 0;
+  for (int i = 0; i < 5; i++)
+    if (strcmp(argv[optind + 1], commands[i]) == 0)
+      cmd = i + 1;
+  if (cmd == 0)
+    usage(argv[0]);
+
+  struct addrinfo hints = {0}, *addr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(argv[optind], port, &hints, &addr) != 0)
+  {
+    fprintf(stderr, "cannot resolve %s\n", argv[optind]);
+    return 1;
+  }
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval tv = {0, TIMEOUT_MS * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0)
+  {
+    perror("connect");
+    return 1;
+  }
+  int multicast = ((ntohl(((struct sockaddr_in *)addr->ai_addr)->sin_addr.s_addr) >> 28) == 0xe);
+  if (multicast && !seqGiven)
+  {
+    fprintf(stderr, "the members of a group do not reply, the sequence number should be given with -s\n");
+    return 1;
+  }
+
+  double *rtt = calloc(count, sizeof(double));
+  int received = 0, lost = 0;
+  for (int n = 0; n < count; n++, seq++)
+  {
+    uint8_t packet[PACKET_SIZE] = {'S', 'H', 1, cmd};
+    packet[8] = arg; packet[9] = arg >> 8;
+    packet[14] = delay; packet[15] = delay >> 8;
+    int resynced = 0;
+  resend:
+    packet[4] = seq; packet[5] = seq >> 8; packet[6] = seq >> 16; packet[7] = seq >> 24;
+    sign(key, packet);
+
+    // The group members do not reply, the datagram is repeated before the execution delay expires
+    if (multicast)
+    {
+      for (int retry = 0; retry < RETRIES; retry++)
+      {
+        send(sock, packet, PACKET_SIZE, 0);
+        usleep(5000);
+      }
+      printf("seq %u: sent to the group\n", seq);
+      if (n + 1 < count)
+        usleep(intervalMs * 1000);
+      continue;
+    }
+
+    // The same sequence number is used for the retries, the command is executed only once
+    int done = 0;
+    for (int retry = 0; retry < RETRIES && !done; retry++)
+    {
+      double start = nowUs();
+      send(sock, packet, PACKET_SIZE, 0);
+      uint8_t reply[PACKET_SIZE];
+      while (!done && recv(sock, reply, PACKET_SIZE, 0) == PACKET_SIZE)
+      {
+        uint64_t tag = sipHash(key, reply, TAG_OFFSET);
+        if (reply[3] != (cmd | 0x80) || memcmp(&reply[4], &packet[4], 4) != 0 || readLE64(&reply[TAG_OFFSET]) != tag)
+          continue;
+        // Not executed: the command is sent again once after the highest sequence number of the device
+        if (reply[10] == STATUS_BAD_SEQUENCE && !resynced)
+        {
+          seq = readLE32(&reply[12]) + 1;
+          printf("seq %u: the device continues after %u\n", (unsigned)readLE32(&packet[4]), seq - 1);
+          resynced = 1;
+          goto resend;
+        }
+        rtt[received++] = nowUs() - start;
+        int16_t temperature = (int16_t)(reply[12] | (reply[13] << 8));
+        printf("seq %u: status %u, light %s, overheat %u, temperature %.1f, rtt %.0f us\n", seq, reply[10],
+               (reply[11] & 1) ? "ON" : "OFF", (reply[11] >> 1) & 1, temperature / 10.0, rtt[received - 1]);
+        done = 1;
+      }
+    }
+    if (!done)
+    {
+      lost++;
+      printf("seq %u: no reply\n", seq);
+    }
+    if (n + 1 < count)
+      usleep(intervalMs * 1000);
+  }
+
+  if (received > 0)
+  {
+    qsort(rtt, received, sizeof(double), compareDouble);
+    double sum = 0;
+    for (int i = 0; i < received; i++)
+      sum += rtt[i];
+    printf("%d replies, %d lost, rtt min %.0f us, avg %.0f us, p50 %.0f us, p99 %.0f us, max %.0f us\n", received, lost,
+           rtt[0], sum / received, rtt[received / 2], rtt[(received * 99) / 100 < received ? (received * 99) / 100 : received - 1], rtt[received - 1]);
+  }
+  free(rtt);
+  freeaddrinfo(addr);
+  close(sock);
+  return lost > 0;
+}
@@ -0,0 +1,436 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <lwip/igmp.h>
+#include <LittleFS.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "light.h"
+#include "switches.h"
+#include "udp.h"
+#include "scheduler.h"
+#include "watchdog.h"
+
+
+namespace udp
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Control with UDP datagrams of 24 bytes, all integers are little endian //
+//   0-1   magic 'S' 'H'                                                  //
+//   2     version                                                        //
+//   3     command, the reply has the same command with the bit 7 set     //
+//   4-7   sequence number, increasing for each new command               //
+//   8-9   argument (blinking duration in s)                              //
+//   10    status (reply only)                                            //
+//   11    state (reply only): bit 0 light on, bit 1 overheating alarm    //
+//   12-13 temperature in tenths of °C (reply only)                       //
+//   14-15 execution delay in ms, 0 for an immediate execution            //
+//   12-15 highest sequence number accepted (reply with BAD_SEQUENCE)     //
+//   16-23 SipHash-2-4 of the bytes 0-15 with the 128 bits key udpKey     //
+// The sequence numbers are checked for the whole device, whatever the    //
+// sender: a command is executed only if its sequence number is above the //
+// highest one accepted, by at most UDP_SEQ_WINDOW. Otherwise the reply   //
+// gives the highest one, so that the sender can continue after it. The   //
+// last command received again gets the previous reply. A floor is kept   //
+// in /udpseq.bin across the reboots, it is reset when the key changes    //
+// The device also listens to the multicast groups of udpGroups. The      //
+// commands sent to a group are not replied. The delay lets all the       //
+// members switch at the same time while the sender repeats the datagram  //
+///////////////////////////////////////////////////////////////////////////
+
+#define UDP_PACKET_SIZE   24
+#define UDP_TAG_OFFSET    16
+#define UDP_VERSION       1
+#define UDP_REPLY_FLAG    0x80
+#define UDP_SEQ_FILE      "/udpseq.bin"
+#define UDP_SEQ_RESERVE   1024      // The floor stored ahead of the accepted sequence numbers, to write the file rarely
+#define UDP_SEQ_WINDOW    1024      // Largest step of the sequence numbers, so that one datagram cannot exhaust them
+#define MAX_UDP_GROUPS    4
+#define UDP_GROUPS_LENGTH 64        // Length of the parameter udpGroups
+#define MAX_UDP_SCHEDULED 4
+
+enum { CMD_ON = 1, CMD_OFF = 2, CMD_TOGGLE = 3, CMD_BLINK = 4, CMD_QUERY = 5 };
+enum { STATUS_OK, STATUS_BAD_COMMAND, STATUS_RATE_LIMITED, STATUS_SCHEDULED, STATUS_BAD_SEQUENCE };
+
+const char* const paramKeys[] = {"udpPort", "udpKey", "udpGroups", NULL};
+
+WiFiUDP udpSocket;
+bool udpEnabled = false;
+uint8_t udpKey[16];
+
+// Replay protection bound to the signed sequence number, not to the address of the sender
+uint32_t lastSeq = 0;                 // Highest sequence number accepted
+uint32_t storedSeq = 0;               // Floor read from the file at the boot, always at or above lastSeq
+uint32_t seqKeyHash = 0;              // Hash of the key of the sequence numbers, they start again with a new key
+bool lastReplyValid = false;
+uint8_t lastReply[UDP_PACKET_SIZE];
+
+// The multicast groups, joined again after each wifi reconnection
+IPAddress groups[MAX_UDP_GROUPS];
+uint8_t nbGroups = 0;
+bool groupsJoined = false;
+
+// The commands waiting for their execution time
+struct ScheduledCommand
+{
+  uint8_t cmd;                  // 0 for a free entry
+  uint16_t arg;
+  unsigned long dueTime;
+};
+ScheduledCommand scheduled[MAX_UDP_SCHEDULED];
+
+uint32_t readLE32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t readLE64(const uint8_t *p)
+{
+  return (uint64_t)readLE32(p) | ((uint64_t)readLE32(p + 4) << 32);
+}
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                \
+  do {                                                          \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                    \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                    \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+  } while (0)
+
+// SipHash-2-4 of a message with a length multiple of 8 bytes
+uint64_t sipHash(const uint8_t *key, const uint8_t *msg, uint8_t len)
+{
+  uint64_t k0 = readLE64(key);
+  uint64_t k1 = readLE64(key + 8);
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+  for (uint8_t i = 0; i < len; i += 8)
+  {
+    uint64_t m = readLE64(msg + i);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  uint64_t b = ((uint64_t)len) << 56;
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void sign(uint8_t *packet)
+{
+  uint64_t tag = sipHash(udpKey, packet, UDP_TAG_OFFSET);
+  for (uint8_t i = 0; i < 8; i++)
+    packet[UDP_TAG_OFFSET + i] = (uint8_t)(tag >> (8 * i));
+}
+
+// Constant time comparison of the tag
+bool checkTag(const uint8_t *packet)
+{
+  uint64_t tag = sipHash(udpKey, packet, UDP_TAG_OFFSET);
+  uint8_t diff = 0;
+  for (uint8_t i = 0; i < 8; i++)
+    diff |= packet[UDP_TAG_OFFSET + i] ^ (uint8_t)(tag >> (8 * i));
+  return diff == 0;
+}
+
+// Convert the key given with 32 hexadecimal characters
+bool parseKey(const char* str)
+{
+  if (str == NULL || strlen(str) != 32)
+    return false;
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    char hex[3] = {str[2 * i], str[2 * i + 1], 0x00};
+    char *end;
+    udpKey[i] = strtoul(hex, &end, 16);
+    if (*end != 0x00)
+      return false;
+  }
+  return true;
+}
+
+// The file has the floor and the hash of the key it has been written with
+void loadSeq(uint32_t keyHash)
+{
+  seqKeyHash = keyHash;
+  lastReplyValid = false;
+  storedSeq = 0;
+  File file = LittleFS.open(UDP_SEQ_FILE, "r");
+  if (file)
+  {
+    uint8_t buf[8];
+    bool ok = (file.read(buf, 8) == 8 && readLE32(&buf[4]) == keyHash);
+    file.close();
+    if (ok)
+      storedSeq = readLE32(buf);
+    else
+    {
+      logging::getLogStream().println("udp: new key, the sequence numbers start again");
+      LittleFS.remove(UDP_SEQ_FILE);
+    }
+  }
+  lastSeq = storedSeq;
+}
+
+// Move the floor ahead of the sequence number before the command is executed,
+// so that it cannot be replayed after a reboot
+void storeSeq(uint32_t seq)
+{
+  storedSeq = (seq > 0xFFFFFFFF - UDP_SEQ_RESERVE) ? 0xFFFFFFFF : seq + UDP_SEQ_RESERVE;
+  File file = LittleFS.open(UDP_SEQ_FILE, "w");
+  if (!file)
+  {
+    logging::getLogStream().printf("udp: cannot write %s\n", UDP_SEQ_FILE);
+    return;
+  }
+  uint8_t buf[8] = {(uint8_t)storedSeq, (uint8_t)(storedSeq >> 8), (uint8_t)(storedSeq >> 16), (uint8_t)(storedSeq >> 24),
+                    (uint8_t)seqKeyHash, (uint8_t)(seqKeyHash >> 8), (uint8_t)(seqKeyHash >> 16), (uint8_t)(seqKeyHash >> 24)};
+  file.write(buf, 8);
+  file.close();
+}
+
+uint8_t execute(uint8_t cmd, uint16_t arg)
+{
+  watchdog::breadcrumb(watchdog::CRUMB_UDP, cmd);
+  uint32_t dropped = light::getCommandsDropped(light::SOURCE_UDP);
+  switch (cmd)
+  {
+    case CMD_ON:
+    light::lightOn(false, light::SOURCE_UDP);
+    break;
+    case CMD_OFF:
+    light::lightOff(light::SOURCE_UDP);
+    break;
+    case CMD_TOGGLE:
+    light::lightToggle(false, light::SOURCE_UDP);
+    break;
+    case CMD_BLINK:
+    {
+      if (arg > 0)
+      {
+        char duration[6];
+        sprintf(duration, "%u", arg);
+        light::setBlinkingDuration(duration);
+      }
+      light::startBlinking();
+      break;
+    }
+    case CMD_QUERY:
+    break;
+    default:
+    return STATUS_BAD_COMMAND;
+  }
+  if (light::getCommandsDropped(light::SOURCE_UDP) != dropped)
+    return STATUS_RATE_LIMITED;
+  return STATUS_OK;
+}
+
+uint8_t schedule(uint8_t cmd, uint16_t arg, uint16_t delay)
+{
+  if (cmd < CMD_ON || cmd > CMD_QUERY)
+    return STATUS_BAD_COMMAND;
+  for (uint8_t i = 0; i < MAX_UDP_SCHEDULED; i++)
+  {
+    if (scheduled[i].cmd == 0)
+    {
+      scheduled[i].cmd = cmd;
+      scheduled[i].arg = arg;
+      scheduled[i].dueTime = millis() + delay;
+      return STATUS_SCHEDULED;
+    }
+  }
+  return STATUS_RATE_LIMITED;
+}
+
+bool isMulticast(const IPAddress &ip)
+{
+  return ip[0] >= 224 && ip[0] <= 239;
+}
+
+void joinGroups(bool join)
+{
+  for (uint8_t i = 0; i < nbGroups; i++)
+  {
+    ip4_addr_t group;
+    group.addr = (uint32_t)groups[i];
+    err_t err = join ? igmp_joingroup(IP4_ADDR_ANY4, &group) : igmp_leavegroup(IP4_ADDR_ANY4, &group);
+    if (err != ERR_OK)
+      logging::getLogStream().printf("udp: cannot %s the group %s\n", join ? "join" : "leave", helpers::ipToStr((uint32_t)groups[i]));
+  }
+  groupsJoined = join;
+}
+
+void sendReply(const uint8_t *reply)
+{
+  udpSocket.beginPacket(udpSocket.remoteIP(), udpSocket.remotePort());
+  udpSocket.write(reply, UDP_PACKET_SIZE);
+  udpSocket.endPacket();
+}
+
+// The reply to a command with a sequence number out of the window, it is not executed
+void sendBadSequence(const uint8_t *packet)
+{
+  uint8_t reply[UDP_PACKET_SIZE];
+  memcpy(reply, packet, UDP_TAG_OFFSET);
+  reply[3] |= UDP_REPLY_FLAG;
+  reply[10] = STATUS_BAD_SEQUENCE;
+  reply[11] = (light::lightIsOn() ? 0x01 : 0x00) | (switches::getOverheatingAlarm() ? 0x02 : 0x00);
+  reply[12] = (uint8_t)lastSeq;
+  reply[13] = (uint8_t)(lastSeq >> 8);
+  reply[14] = (uint8_t)(lastSeq >> 16);
+  reply[15] = (uint8_t)(lastSeq >> 24);
+  sign(reply);
+  sendReply(reply);
+}
+
+void handlePacket(uint8_t *packet)
+{
+  if (packet[0] != 'S' || packet[1] != 'H' || packet[2] != UDP_VERSION || (packet[3] & UDP_REPLY_FLAG))
+    return;
+  if (!checkTag(packet))
+  {
+    logging::getLogStream().printf("udp: bad tag from %s\n", helpers::ipToStr((uint32_t)udpSocket.remoteIP()));
+    return;
+  }
+
+  bool multicast = isMulticast(udpSocket.destinationIP());
+  uint32_t seq = readLE32(&packet[4]);
+  if (seq <= lastSeq || seq - lastSeq > UDP_SEQ_WINDOW)
+  {
+    if (multicast)
+      return;
+    // Retransmission of the last command: the previous reply is sent again
+    if (seq == lastSeq && lastReplyValid && lastReply[3] == (packet[3] | UDP_REPLY_FLAG))
+      sendReply(lastReply);
+    else
+      sendBadSequence(packet);
+    return;
+  }
+  if (seq >= storedSeq)
+    storeSeq(seq);
+  lastSeq = seq;
+
+  uint16_t arg = (uint16_t)packet[8] | ((uint16_t)packet[9] << 8);
+  uint16_t delay = (uint16_t)packet[14] | ((uint16_t)packet[15] << 8);
+  uint8_t status = (delay > 0) ? schedule(packet[3], arg, delay) : execute(packet[3], arg);
+  int16_t temperature = (int16_t)(switches::getTemperature() * 10);
+
+  uint8_t *reply = lastReply;
+  memcpy(reply, packet, UDP_TAG_OFFSET);
+  reply[3] |= UDP_REPLY_FLAG;
+  reply[10] = status;
+  reply[11] = (light::lightIsOn() ? 0x01 : 0x00) | (switches::getOverheatingAlarm() ? 0x02 : 0x00);
+  reply[12] = (uint8_t)temperature;
+  reply[13] = (uint8_t)(temperature >> 8);
+  sign(reply);
+  lastReplyValid = true;
+
+  // No reply to the group commands
+  if (multicast)
+    return;
+  sendReply(reply);
+}
+
+void updateParams()
+{
+  logging::getLogStream().println("udp: updateParams");
+  if (udpEnabled)
+  {
+    if (groupsJoined)
+      joinGroups(false);
+    udpSocket.stop();
+  }
+  udpEnabled = false;
+  lastReplyValid = false;
+  memset(scheduled, 0, sizeof(scheduled));
+
+  // The multicast groups separated by commas
+  nbGroups = 0;
+  const char* groupsStr = wifi::getParamValueFromID("udpGroups");
+  if (groupsStr != NULL)
+  {
+    char str[UDP_GROUPS_LENGTH + 1];
+    strncpy(str, groupsStr, sizeof(str) - 1);
+    str[sizeof(str) - 1] = 0x00;
+    for (char* tok = strtok(str, ", "); tok != NULL && nbGroups < MAX_UDP_GROUPS; tok = strtok(NULL, ", "))
+    {
+      if (groups[nbGroups].fromString(tok) && isMulticast(groups[nbGroups]))
+        nbGroups++;
+      else
+        logging::getLogStream().printf("udp: %s is not a multicast address\n", tok);
+    }
+  }
+
+  const char* keyStr = wifi::getParamValueFromID("udpKey");
+  if (keyStr == NULL)
+    return;
+  if (!parseKey(keyStr))
+  {
+    logging::getLogStream().println("udp: the key should have 32 hexadecimal characters, UDP control disabled");
+    return;
+  }
+  uint16_t port = 4210;
+  helpers::convertToInteger(wifi::getParamValueFromID("udpPort"), port, 5);
+  uint32_t keyHash = helpers::fnv1a(keyStr);
+  if (keyHash != seqKeyHash)
+    loadSeq(keyHash);
+  udpEnabled = udpSocket.begin(port);
+  logging::getLogStream().printf("udp: listening on port %d with %d multicast groups\n", port, nbGroups);
+}
+
+void setup()
+{
+  // The commands are processed as fast as the switches
+  scheduler::addTask("udp", handle, scheduler::PRIORITY_HIGH, 0, 2000);
+}
+
+void handle()
+{
+  if (!udpEnabled)
+    return;
+
+  // The groups can be joined only when the wifi is connected
+  if (WiFi.status() != WL_CONNECTED)
+    groupsJoined = false;
+  else if (!groupsJoined && nbGroups > 0)
+    joinGroups(true);
+
+  // Execute the scheduled commands
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < MAX_UDP_SCHEDULED; i++)
+  {
+    if (scheduled[i].cmd != 0 && (long)(now - scheduled[i].dueTime) >= 0)
+    {
+      execute(scheduled[i].cmd, scheduled[i].arg);
+      scheduled[i].cmd = 0;
+    }
+  }
+
+  // Process all the received datagrams
+  int size;
+  while ((size = udpSocket.parsePacket()) > 0)
+  {
+    uint8_t packet[UDP_PACKET_SIZE];
+    if (size == UDP_PACKET_SIZE && udpSocket.read(packet, UDP_PACKET_SIZE) == UDP_PACKET_SIZE)
+      handlePacket(packet);
+    scheduler::stayAwake();
+    udpSocket.flush();
+  }
+}
+
+}
@@ -0,0 +1,16 @@
+#ifndef UDP_CONTROL
+#define UDP_CONTROL
+
+#include <Arduino.h>
+
+namespace udp
+{
+  // The parameters used by the module
+  extern const char* const paramKeys[];
+
+  void updateParams();
+  void setup();
+  void handle();
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include <Arduino.h>
+#include <user_interface.h>
+
+#include "config.h"
+#include "wifi.h"
+#include "logging.h"
+#include "mqtt.h"
+#include "watchdog.h"
+
+
+namespace watchdog
+{
+
+///////////////////////////////////////////////////////////////////////////
+// Software watchdog for the loop                                        //
+// The scheduler gives the stage (task) being executed. The timer        //
+// interrupt checks that a stage does not last more than STALL_TIMEOUT, //
+// below the 3 s of the ESP8266 software watchdog. The stalls and the    //
+// crashes are written in the RTC memory with the last events, then      //
+// reported at the next boot over MQTT and on /status                    //
+///////////////////////////////////////////////////////////////////////////
+
+#define STALL_TIMEOUT     2000        // In ms
+#define NB_BREADCRUMBS    8
+#define STAGE_NAME_SIZE   12
+#define RECORD_MAGIC      0x57444731  // "WDG1"
+#define REPORT_SIZE       400
+// The user blocks of the RTC memory (system block 64, the one read by ESP.rtcUserMemoryRead(0)) are
+// mapped here, written directly since the SDK functions are not in IRAM
+#define RTC_USER_MEMORY_BASE 0x60001200
+
+enum { RECORD_NONE, RECORD_STALL, RECORD_CRASH };
+
+const char* const CRUMB_NAMES[] = {"boot", "overrun", "isr", "relay", "mqttUp", "mqttDown", "config", "udp", "heapLow", "stallRecovered"};
+
+struct Breadcrumb
+{
+  uint32_t time;          // millis()
+  uint16_t arg;
+  uint8_t code;
+  uint8_t reserved;
+};
+
+// Written in the RTC memory, in blocks of 4 bytes
+struct Record
+{
+  uint32_t magic;
+  uint8_t type;
+  uint8_t nextCrumb;
+  uint16_t recoveredStalls;   // Stalls of this boot where the stage returned before the hardware watchdog
+  char stage[STAGE_NAME_SIZE];
+  uint32_t stallDuration;     // In ms
+  uint32_t uptime;            // In ms
+  uint32_t exccause;
+  uint32_t epc1;
+  uint32_t excvaddr;
+  Breadcrumb crumbs[NB_BREADCRUMBS];
+  uint32_t check;
+};
+
+Record record;                              // Current stage and breadcrumbs
+volatile const char* stageName = NULL;
+volatile uint32_t stageStartTime = 0;
+volatile bool stallRecorded = false;
+
+char report[REPORT_SIZE] = "{}";
+bool reportPending = false;
+
+ICACHE_RAM_ATTR uint32_t recordCheck(const Record &r)
+{
+  uint32_t hash = 2166136261UL;
+  const uint8_t* p = (const uint8_t*)&r;
+  for (uint16_t i = 0; i < offsetof(Record, check); i++)
+    hash = (hash ^ p[i]) * 16777619UL;
+  return hash;
+}
+
+// Called from the loop and from the timer ISR, the previous interrupt level is restored
+ICACHE_RAM_ATTR void breadcrumb(uint8_t code, uint16_t arg)
+{
+  uint32_t savedPS = xt_rsil(15);
+  Breadcrumb &b = record.crumbs[record.nextCrumb];
+  b.time = millis();
+  b.code = code;
+  b.arg = arg;
+  record.nextCrumb = (record.nextCrumb + 1) % NB_BREADCRUMBS;
+  xt_wsr_ps(savedPS);
+}
+
+void enterStage(const char* name)
+{
+  stageStartTime = millis();
+  stageName = name;
+}
+
+// Copy the state in the RTC memory, it survives the resets without power loss
+ICACHE_RAM_ATTR void saveRecord(uint8_t type)
+{
+  record.magic = RECORD_MAGIC;
+  record.type = type;
+  record.uptime = millis();
+  const char* name = (const char*)stageName;
+  uint8_t i = 0;
+  if (name != NULL)
+    for (; i < STAGE_NAME_SIZE - 1 && name[i] != 0x00; i++)
+      record.stage[i] = name[i];
+  record.stage[i] = 0x00;
+  record.check = recordCheck(record);
+  volatile uint32_t* rtc = (volatile uint32_t*)(RTC_USER_MEMORY_BASE + RTC_WATCHDOG_BLOCK * 4);
+  const uint32_t* src = (const uint32_t*)&record;
+  for (uint8_t i = 0; i < sizeof(record) / 4; i++)
+    rtc[i] = src[i];
+}
+
+ICACHE_RAM_ATTR void checkStall()
+{
+  if (stageName == NULL || stallRecorded)
+    return;
+  uint32_t duration = millis() - stageStartTime;
+  if (duration > STALL_TIMEOUT)
+  {
+    // Recorded once per stall, the stage may still return before the hardware watchdog
+    stallRecorded = true;
+    record.stallDuration = duration;
+    saveRecord(RECORD_STALL);
+  }
+}
+
+void leaveStage()
+{
+  const char* name = (const char*)stageName;
+  stageName = NULL;
+  if (!stallRecorded)
+    return;
+  // The stage has returned: the stall is no longer the cause of the next reset, but it is kept in the trail
+  uint32_t duration = millis() - stageStartTime;
+  uint32_t savedPS = xt_rsil(15);
+  record.recoveredStalls++;
+  record.stallDuration = 0;
+  breadcrumb(CRUMB_STALL_RECOVERED, min(duration, (uint32_t)0xFFFF));
+  saveRecord(RECORD_NONE);
+  stallRecorded = false;
+  xt_wsr_ps(savedPS);
+  logging::getLogStream().printf("watchdog: the stage %s has returned after %u ms\n", name, duration);
+}
+
+// Called by the core for the exceptions and the software watchdog resets
+extern "C" void custom_crash_callback(struct rst_info* rstInfo, uint32_t stack, uint32_t stackEnd)
+{
+  record.exccause = rstInfo->exccause;
+  record.epc1 = rstInfo->epc1;
+  record.excvaddr = rstInfo->excvaddr;
+  record.stallDuration = (stageName != NULL) ? millis() - stageStartTime : 0;
+  saveRecord(RECORD_CRASH);
+}
+
+const char* getReport()
+{
+  return report;
+}
+
+// Build the report of the last reset from the reset reason and the RTC record
+void buildReport()
+{
+  struct rst_info* info = ESP.getResetInfoPtr();
+  Record last;
+  bool valid = ESP.rtcUserMemoryRead(RTC_WATCHDOG_BLOCK, (uint32_t*)&last, sizeof(last)) &&
+               last.magic == RECORD_MAGIC && last.check == recordCheck(last) && last.type != RECORD_NONE;
+  uint16_t len = snprintf(report, REPORT_SIZE, "{\"reason\":\"%s\"", ESP.getResetReason().c_str());
+  if (info->reason == REASON_EXCEPTION_RST || info->reason == REASON_SOFT_WDT_RST || info->reason == REASON_WDT_RST)
+    len += snprintf(report + len, REPORT_SIZE - len, ",\"exccause\":%u,\"epc1\":\"0x%08x\",\"excvaddr\":\"0x%08x\"",
+                    info->exccause, info->epc1, info->excvaddr);
+  if (valid)
+  {
+    last.stage[STAGE_NAME_SIZE - 1] = 0x00;
+    len += snprintf(report + len, REPORT_SIZE - len, ",\"record\":\"%s\",\"stage\":\"%s\",\"stall\":%u,\"recoveredStalls\":%u,\"uptime\":%u,\"crumbs\":[",
+                    last.type == RECORD_STALL ? "stall" : "crash", last.stage, last.stallDuration, last.recoveredStalls,
+                    last.uptime / 1000);
+    // From the oldest to the most recent
+    bool first = true;
+    for (uint8_t i = 0; i < NB_BREADCRUMBS; i++)
+    {
+      Breadcrumb &b = last.crumbs[(last.nextCrumb + i) % NB_BREADCRUMBS];
+      if (b.time == 0 || b.code >= NB_CRUMBS || len >= REPORT_SIZE - 2)
+        continue;
+      len += snprintf(report + len, REPORT_SIZE - len, "%s[%u,\"%s\",%u]", first ? "" : ",", b.time, CRUMB_NAMES[b.code], b.arg);
+      first = false;
+    }
+    if (len < REPORT_SIZE - 2)
+      len += snprintf(report + len, REPORT_SIZE - len, "]");
+  }
+  if (len < REPORT_SIZE - 1)
+    snprintf(report + len, REPORT_SIZE - len, "}");
+  else
+    strcpy(report, "{\"reason\":\"report too long\"}");
+
+  // Only reported for the abnormal resets
+  reportPending = valid || info->reason == REASON_EXCEPTION_RST || info->reason == REASON_SOFT_WDT_RST ||
+                  info->reason == REASON_WDT_RST;
+  logging::getLogStream().printf("watchdog: last reset %s\n", report);
+}
+
+// Publish the report once after an abnormal reset
+void publishReport()
+{
+  if (!reportPending)
+    return;
+  const char* topic = wifi::getParamValueFromID("pubMqttCrashReport");
+  if (topic == NULL || mqtt::publishMQTT(topic, report))
+    reportPending = false;
+}
+
+void setup()
+{
+  buildReport();
+  // The record of this boot starts empty
+  memset(&record, 0x00, sizeof(record));
+  saveRecord(RECORD_NONE);
+  // The direct writes and the SDK reads must address the same blocks
+  Record check;
+  if (!ESP.rtcUserMemoryRead(RTC_WATCHDOG_BLOCK, (uint32_t*)&check, sizeof(check)) ||
+      check.magic != RECORD_MAGIC || check.check != record.check)
+    logging::getLogStream().printf("watchdog: the record written in the RTC memory does not read back, no report after a stall\n");
+  breadcrumb(CRUMB_BOOT, ESP.getResetInfoPtr()->reason);
+}
+
+}
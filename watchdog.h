@@ -0,0 +1,25 @@
+#ifndef WATCHDOG
+#define WATCHDOG
+
+#include <Arduino.h>
+
+namespace watchdog
+{
+  // The events kept in the breadcrumb trail
+  enum { CRUMB_BOOT, CRUMB_TASK_OVERRUN, CRUMB_ISR_OVERRUN, CRUMB_RELAY, CRUMB_MQTT_CONNECTED, CRUMB_MQTT_LOST,
+         CRUMB_CONFIG_SAVED, CRUMB_UDP, CRUMB_HEAP_LOW, CRUMB_STALL_RECOVERED, NB_CRUMBS };
+
+  ICACHE_RAM_ATTR void breadcrumb(uint8_t code, uint16_t arg=0);
+  // The loop stage being executed, NULL when between two stages
+  void enterStage(const char* name);
+  void leaveStage();
+  // Called from the timer interrupt to detect a stalled stage
+  ICACHE_RAM_ATTR void checkStall();
+
+  // Report of the last reset in JSON
+  const char* getReport();
+  void publishReport();
+  void setup();
+}
+
+#endif
@@ -0,0 +1,46 @@
+// Generated by tools/build_web_assets.py from the web folder, do not edit
+#ifndef WEB_ASSETS
+#define WEB_ASSETS
+
+#include <Arduino.h>
+
+namespace webAssets
+{
+  struct Asset
+  {
+    const char* uri;
+    const char* contentType;
+    const uint8_t* data;       // gzip, in flash
+    uint16_t length;
+    const char* etag;
+  };
+
+  // upload.html: 504 bytes, 258 bytes gzipped
+  const uint8_t UPLOAD_HTML_GZ[] PROGMEM = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x4d, 0x90, 0xcb, 0x6a, 0xc3, 0x30,
+    0x10, 0x45, 0x7f, 0x45, 0xd5, 0xba, 0xc2, 0xb4, 0x8b, 0x90, 0x85, 0x64, 0x28, 0xa9, 0x17, 0x5d,
+    0x35, 0xd0, 0x06, 0xda, 0x55, 0x19, 0x5b, 0xe3, 0x78, 0x40, 0xaf, 0xda, 0x23, 0x87, 0xfc, 0x7d,
+    0x15, 0xdb, 0x81, 0x6e, 0x24, 0xe6, 0x71, 0xef, 0x3d, 0x8c, 0x7e, 0x78, 0x7d, 0x3f, 0x7c, 0x7e,
+    0x1f, 0x1b, 0x31, 0xb0, 0x77, 0xb5, 0xde, 0x5e, 0x04, 0x5b, 0x6b, 0x26, 0x76, 0x58, 0x37, 0x1f,
+    0xc7, 0xfd, 0xf3, 0x6e, 0x27, 0x4e, 0xc9, 0x45, 0xb0, 0xba, 0x5a, 0xbb, 0xda, 0x23, 0x83, 0xe8,
+    0x06, 0x18, 0x27, 0x64, 0x23, 0x33, 0xf7, 0x6a, 0x2f, 0xb7, 0xee, 0xc0, 0x9c, 0x14, 0xfe, 0x66,
+    0x9a, 0x8d, 0xfc, 0x52, 0xa7, 0x17, 0x75, 0x88, 0x3e, 0x01, 0x53, 0xeb, 0x50, 0x8a, 0x2e, 0x06,
+    0xc6, 0x50, 0x24, 0x6f, 0x8d, 0x41, 0x7b, 0xc6, 0xbb, 0x28, 0x80, 0x47, 0x23, 0x67, 0xc2, 0x4b,
+    0x8a, 0x23, 0xff, 0xdb, 0xbb, 0x90, 0xe5, 0xc1, 0x58, 0x9c, 0xa9, 0x43, 0xb5, 0x14, 0x8f, 0x82,
+    0x02, 0x31, 0x81, 0x53, 0x53, 0x07, 0x0e, 0xcd, 0x53, 0xf1, 0xa8, 0x56, 0xe4, 0x36, 0xda, 0x6b,
+    0xad, 0xfb, 0x38, 0x7a, 0x01, 0x1d, 0x53, 0x0c, 0x46, 0x56, 0xc5, 0xa9, 0xa7, 0xf3, 0x4f, 0x5e,
+    0xf8, 0xa5, 0x28, 0x69, 0x43, 0xb4, 0x46, 0xa6, 0x38, 0x95, 0x18, 0x0c, 0x1d, 0x5f, 0x53, 0x49,
+    0xf6, 0xd9, 0x31, 0x25, 0x18, 0xb9, 0xba, 0xa9, 0x95, 0x05, 0x86, 0x62, 0x4b, 0x21, 0x65, 0x16,
+    0xeb, 0x46, 0x4f, 0x37, 0xfe, 0x95, 0x73, 0x1b, 0xb7, 0x99, 0x39, 0x86, 0xfa, 0x7e, 0x9a, 0xad,
+    0xd4, 0x8b, 0x45, 0xf9, 0x56, 0x9a, 0x6a, 0xb9, 0xe9, 0x1f, 0x6e, 0x4c, 0x9d, 0xad, 0x69, 0x01,
+    0x00, 0x00,
+  };
+
+  const Asset ASSETS[] =
+  {
+    {"/config_upload", "text/html", UPLOAD_HTML_GZ, sizeof(UPLOAD_HTML_GZ), "\"e126c7ecb789b153\""},
+  };
+  const uint8_t NB_ASSETS = sizeof(ASSETS) / sizeof(Asset);
+}
+
+#endif
@@ -9,6 +9,18 @@
 #include "logging.h"
 #include "config.h"
 #include "mqtt.h"
+#include "light.h"
+#include "switches.h"
+#include "discovery.h"
+#include "status.h"
+#include "events.h"
+#include "udp.h"
+#include "rules.h"
+#include "schedule.h"
+#include "scheduler.h"
+#include "watchdog.h"
+#include "metrics.h"
+#include "web_assets.h"
 
 
 namespace wifi {
@@ -22,6 +34,24 @@ WiFiManager &getWifiManager() {
   return wifiManager;
 }
 
+// On-demand portal: when the full portal of WiFiManager is stopped, a light server answers on
+// the same port with only the control endpoints, and /portal to start the full portal again
+enum { PORTAL_ALWAYS, PORTAL_ON_DEMAND };
+ESP8266WebServer lightServer(80);
+ESP8266WebServer *activeServer = NULL;        // The server the modules bind to and respond with
+bool lightServerBound = false;
+bool portalActive = true;                     // The config portal runs during the setup
+volatile bool portalRequested = false;
+bool wifiConnected = false;                   // The setup has connected to the WiFi
+uint8_t portalMode = PORTAL_ALWAYS;
+uint16_t portalTimeout = 300;                 // In s
+unsigned long lastPortalActivityTime = 0;
+
+ESP8266WebServer *getWebServer()
+{
+  return activeServer;
+}
+
 const char version[] = "Build Date & Time: " __DATE__ ", " __TIME__;
 
 // Parameters for the firmware and configuration file
@@ -43,6 +73,11 @@ WiFiManagerParameter switchParams[] =
   WiFiManagerParameter("switchType", "Switch type (1: push button, 2: toggle button)", "2", 2),
   WiFiManagerParameter("defaultReleaseState", "Switch state for light off (0: open, 1: close(less prone to noise))", "0", 2),
   WiFiManagerParameter("autoOffTimer", "Auto-off timer (value in seconds). Auto-off is disable for long push button press.", "", 3),
+  WiFiManagerParameter("relayMinDwell", "Minimum time between two relay changes, the commands received meanwhile are merged (ms)", "250", 5),
+  WiFiManagerParameter("sleepMode", "Sleep when idle (0: never, 1: modem sleep, 2: light sleep)", "0", 2),
+  WiFiManagerParameter("sleepMaxDelay", "Maximum sleep duration, delay for the network commands when sleeping (ms)", "100", 5),
+  WiFiManagerParameter("portalMode", "Configuration portal (0: always running, 1: on demand with /portal, MQTT or a rule)", "0", 2),
+  WiFiManagerParameter("portalTimeout", "Delay before stopping the portal started on demand when idle (s)", "300", 5),
 };
 
 // The MQTT server parameters
@@ -52,6 +87,11 @@ WiFiManagerParameter MQTTParams[] =
   WiFiManagerParameter("<br/><br/><hr><h3>MQTT server</h3>"),
   WiFiManagerParameter("mqttServer", "IP of the broker", "", 40),
   WiFiManagerParameter("mqttPort", "Port", "1883", 6),
+  WiFiManagerParameter("mqttFallbackServers", "Fallback brokers (host[:port] separated by commas)", "", 100),
+  WiFiManagerParameter("mqttBackoffMin", "Minimum delay before reconnecting (ms)", "1000", 6),
+  WiFiManagerParameter("mqttBackoffMax", "Maximum delay before reconnecting (s)", "60", 6),
+  WiFiManagerParameter("mqttLoopBudget", "Time budget for processing the received messages in each loop (us, 0: one message per loop)", "2000", 6),
+  WiFiManagerParameter("mqttPersistentSession", "Persistent session (0: clean session, 1: the broker keeps the subscriptions and the commands)", "0", 2),
 
   // The MQTT publish
   WiFiManagerParameter("<br/><br/><hr><h3>MQTT publish</h3>"),
@@ -59,6 +99,10 @@ WiFiManagerParameter MQTTParams[] =
   WiFiManagerParameter("pubMqttSwitchEvents", "Switch events", "switch/shellyDevice", 100),
   WiFiManagerParameter("pubMqttAlarmOverheat", "Overheat alarm", "shellyDevice/alarm/overheat", 100),
   WiFiManagerParameter("pubMqttTemperature", "Internal temperature", "temperature/shellyDevice", 100),
+  WiFiManagerParameter("pubMqttCrashReport", "Report of the last crash", "shellyDevice/crash", 100),
+  WiFiManagerParameter("pubMqttMetrics", "Heap and stack metrics (JSON)", "shellyDevice/metrics", 100),
+  WiFiManagerParameter("pubMqttConfigAck", "Acknowledgement of the configuration changes (JSON with the configuration hash)", "configAck/shellyDevice", 100),
+  WiFiManagerParameter("pubMqttStatus", "Status (retained JSON state, {\"status\":\"offline\"} as last will)", "shellyDevice/status", 100),
 
   // The MQTT subscribe
   WiFiManagerParameter("<br/><br/><hr><h3>MQTT subscribe</h3>"),
@@ -66,11 +110,41 @@ WiFiManagerParameter MQTTParams[] =
   WiFiManagerParameter("subMqttLightAllOn", "Topic for switching on all lights", "switchOnAll", 100),
   WiFiManagerParameter("subMqttLightOff", "Topic for switching off", "switchOff/shellyDevice", 100),
   WiFiManagerParameter("subMqttLightToggle", "Topic for light toggling", "toggle/shellyDevice", 100),  
+  WiFiManagerParameter("subMqttLightSet", "Topic for setting the light with the payload ON, OFF or TOGGLE", "set/shellyDevice", 100),
   WiFiManagerParameter("subMqttLightAllOff", "Topic for switching off all lights", "switchOffAll", 100),
   WiFiManagerParameter("subMqttBlinkingPattern", "Topic for starting blinking with the pattern given in the MQTT message. \
                                                   The pattern is optional. It is specified with a sequence of integers indicating \
                                                   the duration of the on/off states. The durations are in tenths of seconds.", "startBlinking", 100),
   WiFiManagerParameter("subMqttBlinkingDuration", "Topic for changing the blinking duration in seconds", "setBlinkingDuration", 100),
+  WiFiManagerParameter("subMqttConfig", "Topic for changing the configuration with a JSON containing the parameters to change", "config/shellyDevice", 100),
+  WiFiManagerParameter("subMqttPortal", "Topic for starting the configuration portal", "portal/shellyDevice", 100),
+
+  // Home Assistant
+  WiFiManagerParameter("<br/><br/><hr><h3>Home Assistant</h3>"),
+  WiFiManagerParameter("haDiscoveryPrefix", "MQTT discovery prefix (empty: discovery disabled)", "", 30),
+
+  // Local control with UDP
+  WiFiManagerParameter("<br/><br/><hr><h3>UDP control</h3>"),
+  WiFiManagerParameter("udpPort", "Port", "4210", 6),
+  WiFiManagerParameter("udpKey", "Key for authenticating the datagrams (32 hexadecimal characters, empty: UDP control disabled)", "", 33),
+  WiFiManagerParameter("udpGroups", "Multicast groups for the commands sent to several devices (IP addresses separated by commas)", "", 64),
+
+  // Local automations
+  WiFiManagerParameter("<br/><br/><hr><h3>Rules</h3>"),
+  WiFiManagerParameter("rules", "Rules separated by ';', as &lt;trigger&gt; [if &lt;condition&gt;] then &lt;action&gt;, \
+                                 e.g. switch 1 double then publish switchOffAll off; overheat then blink 30", "", 250),
+
+  // Heap monitoring
+  WiFiManagerParameter("<br/><br/><hr><h3>Metrics</h3>"),
+  WiFiManagerParameter("metricsInterval", "Interval for publishing the metrics (s, 0: only on alarm)", "60", 6),
+  WiFiManagerParameter("heapAlarm", "Alarm when the largest free block of the heap is below (bytes, 0: no alarm)", "4096", 6),
+
+  // Schedule
+  WiFiManagerParameter("<br/><br/><hr><h3>Schedule</h3>"),
+  WiFiManagerParameter("ntpServer", "NTP server (empty: free-running clock)", "pool.ntp.org", 40),
+  WiFiManagerParameter("timezone", "Time zone (POSIX TZ string, e.g. CET-1CEST,M3.5.0,M10.5.0/3)", "UTC0", 40),
+  WiFiManagerParameter("schedule", "Entries separated by ';', as &lt;minute&gt; &lt;hour&gt; &lt;day of week&gt; on|off|toggle, \
+                                    e.g. 30 7 1-5 on; 0 23 * off", "", 250),
 };
 
 // The debugging options
@@ -81,10 +155,103 @@ WiFiManagerParameter loggingParams[] =
   WiFiManagerParameter("<a href=\"/log.txt\">Open_the_log_file</a>&emsp;<a href=\"/erase_log_file\">Erase_the_log_file</a><br/><br/>"),
 };
 
+// Can be called from the callbacks, the portal is started by the next handle()
+void requestPortal()
+{
+  if (!portalActive)
+    portalRequested = true;
+}
+
+void startLightServer()
+{
+  activeServer = &lightServer;
+  if (!lightServerBound)
+  {
+    light::bindServerCallback();
+    status::bindServerCallback();
+    events::bindServerCallback();
+    metrics::bindServerCallback();
+    lightServer.on("/portal", []() {
+                     requestPortal();
+                     lightServer.sendHeader("Location", "/", true);
+                     lightServer.send(303);
+                   });
+    lightServer.onNotFound([]() { lightServer.send(404, "text/plain", "404: Not found, /portal starts the configuration portal"); });
+    lightServerBound = true;
+  }
+  lightServer.begin();
+}
+
+void handleSeverPathNotFound();
+
+void startPortal()
+{
+  if (portalActive)
+    return;
+  logging::getLogStream().println("wifi: starting the portal");
+  lightServer.close();
+  portalActive = true;
+  lastPortalActivityTime = millis();
+  // The callbacks are bound again to the new server of WiFiManager
+  wifiManager.startWebPortal();
+  // When a client requests an unknown URI (i.e. something other than "/"), call function "handleNotFound"
+  // Should be done after startWebPortal()
+  wifiManager.server.get()->onNotFound(handleSeverPathNotFound);
+}
+
+void stopPortal()
+{
+  if (!portalActive)
+    return;
+  logging::getLogStream().println("wifi: stopping the portal");
+  if (wifiManager.getWebPortalActive())
+    wifiManager.stopWebPortal();
+  if (wifiManager.getConfigPortalActive())
+    wifiManager.stopConfigPortal();
+  portalActive = false;
+  startLightServer();
+}
+
+const char* const portalKeys[] = {"portalMode", "portalTimeout", NULL};
+
+void updatePortalParams()
+{
+  logging::getLogStream().println("wifi: updatePortalParams");
+  uint16_t val = PORTAL_ALWAYS;
+  helpers::convertToInteger(getParamValueFromID("portalMode"), val, 1);
+  portalMode = (val == PORTAL_ON_DEMAND) ? PORTAL_ON_DEMAND : PORTAL_ALWAYS;
+  val = 300;
+  helpers::convertToInteger(getParamValueFromID("portalTimeout"), val, 5);
+  portalTimeout = val;
+  // Back to the portal always running
+  if (portalMode == PORTAL_ALWAYS)
+    requestPortal();
+}
+
 void handle()
 {
-  // Handle for the config portal
-  wifiManager.process();
+  if (portalRequested)
+  {
+    portalRequested = false;
+    startPortal();
+  }
+
+  if (portalActive)
+  {
+    // Handle for the config portal
+    wifiManager.process();
+    // The portal is idle when no client is connected to its server
+    unsigned long now = millis();
+    if (wifiManager.server && wifiManager.server->client().connected())
+      lastPortalActivityTime = now;
+    else if (wifiConnected && portalMode == PORTAL_ON_DEMAND && now - lastPortalActivityTime > (unsigned long)portalTimeout * 1000)
+    {
+      logging::getLogStream().printf("wifi: portal idle for %d s\n", portalTimeout);
+      stopPortal();
+    }
+  }
+  else
+    lightServer.handleClient();
 
   // Update the built-in led to show the wifi connection status
   // Try to reconnect every minute if not connected
@@ -149,25 +316,95 @@ int getIndexFromID(const char* str)
   return -1;
 }
 
-// Update the system with the new params
-void updateSystemWithWifiManagerParams()
+void updateHostname()
 {
   // Update the configuration for the wifiManager
   const char* hn = getParamValueFromID("hostname");
   if (hn != NULL && strlen(hn) > 0)
     wifiManager.setHostname(hn);
+}
+
+const char* const hostnameKeys[] = {"hostname", NULL};
+
+// The subsystems with the parameters they depend on
+// A subsystem is updated only if one of its parameters has changed, in the order of the table
+struct Subsystem
+{
+  const char* const* keys;      // The parameter IDs, ending with '*' for a prefix
+  void (*updateParams)();
+};
+const Subsystem subsystems[] =
+{
+  {hostnameKeys, updateHostname},
+  {portalKeys, updatePortalParams},
+  {logging::paramKeys, logging::updateParams},          // Logging should be done first
+  {mqtt::tuningKeys, mqtt::updateTuningParams},
+  {mqtt::paramKeys, mqtt::updateParams},
+  {mqtt::subscriptionKeys, mqtt::updateSubscriptions},
+  {switches::paramKeys, switches::updateParams},
+  {light::paramKeys, light::updateParams},
+  {discovery::paramKeys, discovery::publishConfig},
+  {udp::paramKeys, udp::updateParams},
+  {rules::paramKeys, rules::updateParams},
+  {schedule::clockKeys, schedule::updateClockParams},
+  {schedule::paramKeys, schedule::updateParams},
+  {scheduler::paramKeys, scheduler::updateParams},
+  {metrics::paramKeys, metrics::updateParams},
+};
+
+// Hash of the value of each parameter when the subsystems were last updated
+#define MAX_PARAMS 64
+uint32_t paramHashes[MAX_PARAMS] = {0};
 
-  // Update the configuration settings for logging -> should be done first
-  logging::updateParams();
+bool keyMatches(const char* const* keys, const char* id)
+{
+  for (; *keys != NULL; keys++)
+  {
+    size_t len = strlen(*keys);
+    if (len > 0 && (*keys)[len - 1] == '*')
+    {
+      if (strncmp(*keys, id, len - 1) == 0)
+        return true;
+    }
+    else if (strcmp(*keys, id) == 0)
+      return true;
+  }
+  return false;
+}
 
-  // Update the configuration settings for MQTT
-  mqtt::updateParams();
+// Update the system with the new params
+// Only the subsystems depending on the parameters that have changed are updated
+void updateSystemWithWifiManagerParams()
+{
+  WiFiManagerParameter** customParams = wifiManager.getParameters();
+  int nbParams = min(wifiManager.getParametersCount(), MAX_PARAMS);
 
-  // Update the configuration settings for the switches
-  switches::updateParams();
+  // Find the parameters that have changed
+  bool changed[MAX_PARAMS];
+  for (int i = 0; i < nbParams; i++)
+  {
+    changed[i] = false;
+    if (customParams[i]->getID() == NULL || strlen(customParams[i]->getID()) == 0)
+      continue;
+    uint32_t hash = helpers::fnv1a(customParams[i]->getValue());
+    if (hash != paramHashes[i])
+    {
+      paramHashes[i] = hash;
+      changed[i] = true;
+    }
+  }
 
-  // Update the configuration settings for the dimmer
-  light::updateParams();
+  for (uint8_t s = 0; s < sizeof(subsystems) / sizeof(Subsystem); s++)
+  {
+    for (int i = 0; i < nbParams; i++)
+    {
+      if (changed[i] && keyMatches(subsystems[s].keys, customParams[i]->getID()))
+      {
+        subsystems[s].updateParams();
+        break;
+      }
+    }
+  }
 }
 
 // callback to save the custom params
@@ -211,6 +448,7 @@ void saveParams()
 
   // Close the file
   configFile.close();
+  watchdog::breadcrumb(watchdog::CRUMB_CONFIG_SAVED);
   //logging::getLogStream().printf("wifi: saving: ");
   //logging::getLogStream().println();
 
@@ -219,6 +457,67 @@ void saveParams()
 }
 
 
+// Hash of the whole configuration, to check that the devices have the same settings
+uint32_t getConfigHash()
+{
+  uint32_t hash = helpers::fnv1a(NULL);
+  WiFiManagerParameter** customParams = wifiManager.getParameters();
+  for (int i = 0; i < wifiManager.getParametersCount(); i++)
+  {
+    if (customParams[i]->getID() == NULL || strlen(customParams[i]->getID()) == 0)
+      continue;
+    hash = helpers::fnv1a(customParams[i]->getID(), hash);
+    hash = helpers::fnv1a(customParams[i]->getValue(), hash);
+  }
+  return hash;
+}
+
+// Apply a partial configuration given as JSON, only the parameters with a new value are changed
+// Return the number of parameters changed. The caller should call saveParams() if some have changed
+uint8_t applyConfigPatch(const char* json, unsigned int length)
+{
+  DynamicJsonDocument jsonBuffer(1024);
+  DeserializationError error = deserializeJson(jsonBuffer, json, length);
+  if (error)
+  {
+    logging::getLogStream().printf("wifi: failed to parse the configuration patch\n");
+    return 0;
+  }
+  uint8_t nbChanged = 0;
+  WiFiManagerParameter** customParams = wifiManager.getParameters();
+  JsonObject root = jsonBuffer.as<JsonObject>();
+  for (JsonObject::iterator it = root.begin(); it != root.end(); ++it)
+  {
+    int idx = getIndexFromID(it->key().c_str());
+    if (idx == -1)
+    {
+      logging::getLogStream().printf("wifi: key \"%s\" not found\n", it->key().c_str());
+      continue;
+    }
+    // The values can be given as string or integer
+    char buff[12];
+    const char* value = NULL;
+    if (it->value().is<const char*>())
+      value = it->value().as<const char*>();
+    else if (it->value().is<long>())
+    {
+      snprintf(buff, sizeof(buff), "%ld", it->value().as<long>());
+      value = buff;
+    }
+    if (value == NULL || strlen(value) > customParams[idx]->getValueLength())
+    {
+      logging::getLogStream().printf("wifi: wrong value for the key \"%s\"\n", it->key().c_str());
+      continue;
+    }
+    if (customParams[idx]->getValue() != NULL && strcmp(customParams[idx]->getValue(), value) == 0)
+      continue;
+    logging::getLogStream().printf("wifi: changing \"%s\" to \"%s\"\n", it->key().c_str(), value);
+    customParams[idx]->setValue(value, customParams[idx]->getValueLength());
+    nbChanged++;
+  }
+  return nbChanged;
+}
+
 // callback to load the custom params
 void loadParams()
 {
@@ -268,28 +567,20 @@ void loadParams()
   }
 }
 
-void handlePrepareConfigFileUpload()
-{
-  char temp[700];
-
-  snprintf ( temp, 700,
-             "<!DOCTYPE html>\
-    <html>\
-      <head>\
-        <title>ESP8266 Upload</title>\
-        <meta charset=\"utf-8\">\
-        <meta http-equiv=\"X-UA-Compatible\" content=\"IE=edge\">\
-        <meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\
-      </head>\
-      <body>\
-        <form action=\"/config_upload\" method=\"post\" enctype=\"multipart/form-data\">\
-          <input type=\"file\" name=\"data\">\
-          <button>Upload</button>\
-         </form>\
-      </body>\
-    </html>"
-           );
-  wifiManager.server.get()->send ( 200, "text/html", temp );
+// The pages of web/, gzipped in flash by tools/build_web_assets.py
+// The browser revalidates with the ETag and gets a 304 when the firmware has not changed the page
+void sendWebAsset(const webAssets::Asset &asset)
+{
+  ESP8266WebServer *server = wifiManager.server.get();
+  server->sendHeader("ETag", asset.etag);
+  server->sendHeader("Cache-Control", "no-cache");
+  if (server->header("If-None-Match") == asset.etag)
+  {
+    server->send(304);
+    return;
+  }
+  server->sendHeader("Content-Encoding", "gzip");
+  server->send_P(200, asset.contentType, (PGM_P)asset.data, asset.length);
 }
 
 void handleConfigFileUpload()
@@ -377,8 +668,23 @@ void handleSeverPathNotFound()
   }
 }
 
+// The planned reboots keep the time for the schedule, the RTC memory survives them
+void reboot()
+{
+  schedule::saveClockBeforeReboot();
+  wifiManager.reboot();
+}
+
 void bindServerCallback()
 {
+  // Called by WiFiManager when it creates its server
+  activeServer = wifiManager.server.get();
+  // Registered before the restart of the menu of WiFiManager, which reboots without any callback
+  wifiManager.server.get()->on("/restart", []() {
+                               wifiManager.server.get()->send(200, "text/plain", "Restarting");
+                               delay(2000);
+                               reboot();
+                             });
   // Handle for managing the log file on LittleFS
   wifiManager.server.get()->on("/log.txt", handleFileDownload);
   wifiManager.server.get()->on("/erase_log_file", logging::eraseLogFile);
@@ -386,14 +692,24 @@ void bindServerCallback()
   // Handle to backup the configuration file
   wifiManager.server.get()->on("/config.json", handleFileDownload);
   
+  // The static pages, the one for /config_upload sends the file to upload
+  static const char* headerKeys[] = {"If-None-Match"};
+  wifiManager.server.get()->collectHeaders(headerKeys, 1);
+  for (uint8_t i = 0; i < webAssets::NB_ASSETS; i++)
+    wifiManager.server.get()->on(webAssets::ASSETS[i].uri, HTTP_GET, [i]() { sendWebAsset(webAssets::ASSETS[i]); });
+
   // Handle to upload the configuration file
-  wifiManager.server.get()->on("/config_upload", HTTP_GET, handlePrepareConfigFileUpload);
   wifiManager.server.get()->on("/config_upload", HTTP_POST, []() {
                                wifiManager.server.get()->send(200, "text/plain", "Finished uploading the configuration file");
                              }, handleConfigFileUpload);
 
   // callbacks for updating the STM32 firmware
   light::bindServerCallback();
+
+  // JSON status of the device
+  status::bindServerCallback();
+  events::bindServerCallback();
+  metrics::bindServerCallback();
 }
 
 void factoryReset()
@@ -406,7 +722,7 @@ void factoryReset()
     logging::getLogStream().println("wifi: LittleFS erased");
   // LittleFS should be unmounted in order to effectivly erae the all the files
   LittleFS.end();
-  wifiManager.reboot();
+  reboot();
 }
 
 void prepareOTA()
@@ -415,6 +731,8 @@ void prepareOTA()
   switches::disableInterrupt(),
   // Disable the serial connection since it can also corrupt the OTA update
   Serial.end();
+  // WiFiManager reboots after the update
+  schedule::saveClockBeforeReboot();
 }
 
 void setup()
@@ -487,7 +805,7 @@ void setup()
     if ((WiFi.SSID()!=nullptr) && (WiFi.softAPgetStationNum()==0) && (millis() - startAPTime > 60000))
     {
       logging::getLogStream().println("wifi: still in AP mode; reboot now");
-      wifiManager.reboot();
+      reboot();
     }
   }
 
@@ -495,13 +813,24 @@ void setup()
   logging::getLogStream().println("wifi: connected to wifi network!");
   // Set station mode
   WiFi.mode(WIFI_STA);
-  wifiManager.startWebPortal();                             // Start the web server of WifiManager
-  // When a client requests an unknown URI (i.e. something other than "/"), call function "handleNotFound"
-  // Should be done after startWebPortal()
-  wifiManager.server.get()->onNotFound(handleSeverPathNotFound);
+  wifiConnected = true;
+  if (portalMode == PORTAL_ALWAYS)
+  {
+    portalActive = false;
+    startPortal();                                          // Start the web server of WifiManager
+  }
+  else
+  {
+    // Only the light server until the portal is requested
+    portalActive = true;
+    stopPortal();
+  }
 
   // Setup for MQTT
   mqtt::setup();
+
+  // The web portal has the lowest priority so that it does not delay the switches
+  scheduler::addTask("portal", handle, scheduler::PRIORITY_LOW, 0, 10000);
 }
 
 
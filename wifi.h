@@ -16,6 +16,10 @@
 namespace wifi {
 
   WiFiManager &getWifiManager();
+  // The server of the portal, or the light server when the portal is stopped
+  ESP8266WebServer *getWebServer();
+  // Start the full portal at the next loop, when it runs on demand
+  void requestPortal();
   
   
   void handle();
@@ -23,6 +27,8 @@ namespace wifi {
   const char* getIDFromParamValue(const char* str);
   void updateSystemWithWifiManagerParams();
   void saveParams();
+  uint8_t applyConfigPatch(const char* json, unsigned int length);
+  uint32_t getConfigHash();
   void loadParams();
   void bindServerCallback();
   void setup();